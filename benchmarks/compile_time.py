@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""
+Measures how much including iro.h adds to the compile time of a translation unit that logs one colored line,
+with and without IRO_LEAN
+
+usage: compile_time.py [--compiler g++] [--runs 25] [--before path/to/an/older/iro.h]
+
+Every configuration is compiled --runs times (interleaved, so that noise affects them all the same), and the median CPU time is reported
+"""
+
+import argparse
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+
+WITHOUT_IRO = """#include <iostream>
+void log_warning(const char* msg) { std::cout << "[warning] " << msg << '\\n'; }
+"""
+
+WITH_IRO = """#include <iostream>
+#include "iro.h"
+void log_warning(const char* msg) { std::cout << iro::yellow << "[warning] " << msg << '\\n'; }
+"""
+
+
+def cpu_time(command):
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    subprocess.run(command, check=True)
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return (after.ru_utime + after.ru_stime) - (before.ru_utime + before.ru_stime)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--compiler", default=os.environ.get("CXX", "g++"))
+    parser.add_argument("--runs", type=int, default=25)
+    parser.add_argument("--before", help="an older iro.h to compare against")
+    args = parser.parse_args()
+
+    repo = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    with tempfile.TemporaryDirectory() as directory:
+        without_iro = os.path.join(directory, "without_iro.cpp")
+        with_iro = os.path.join(directory, "with_iro.cpp")
+        with open(without_iro, "w") as f:
+            f.write(WITHOUT_IRO)
+        with open(with_iro, "w") as f:
+            f.write(WITH_IRO)
+
+        configurations = [("no iro", without_iro, [])]
+        if args.before:
+            before_directory = os.path.join(directory, "before")
+            os.mkdir(before_directory)
+            shutil.copy(args.before, os.path.join(before_directory, "iro.h"))
+            configurations.append(("before", with_iro, ["-I" + before_directory]))
+        configurations.append(("iro.h", with_iro, ["-I" + repo]))
+        configurations.append(("iro.h, IRO_LEAN", with_iro, ["-I" + repo, "-DIRO_LEAN"]))
+
+        times = {name: [] for name, _, _ in configurations}
+        for _ in range(args.runs):
+            for name, source, flags in configurations:
+                times[name].append(cpu_time([args.compiler, "-std=c++14", "-O2", *flags, "-c", source, "-o", os.devnull]))
+
+    baseline = sorted(times["no iro"])[args.runs//2]
+    for name, _, _ in configurations:
+        median = sorted(times[name])[args.runs//2]
+        print("{:16} {:5.0f} ms  ({:+5.0f} ms)".format(name, median*1000, (median-baseline)*1000))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
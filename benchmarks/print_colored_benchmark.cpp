@@ -0,0 +1,53 @@
+// Measures how fast print_colored is. Build in release mode (cmake -DCMAKE_BUILD_TYPE=Release) before trusting the numbers
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#define IRO_IMPL
+#include "iro.h"
+
+template<typename T>
+void run(const char* name, const std::string& text, const std::vector<T>& colors) {
+    constexpr unsigned repetitions = 5;
+
+    double best = 1e9;
+    std::size_t size = 0;
+    for(unsigned i = 0; i < repetitions; ++i) {
+        std::stringstream ss;
+        auto start = std::chrono::steady_clock::now();
+        iro::print_colored(ss, text, colors.data(), colors.size());
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+        size = static_cast<std::size_t>(ss.tellp());
+    }
+
+    std::cout << name << ": " << colors.size()/best/1e6 << " M characters/s (" << size << " bytes written)\n";
+}
+
+int main() {
+    constexpr std::size_t count = 10000000;
+
+    std::string ascii(count, '#');
+
+    std::string utf8;
+    for(std::size_t i = 0; i < count; ++i) {
+        utf8 += "\xe2\x96\x88"; // a full block
+    }
+
+    std::vector<iro::color::color> c16(count);
+    std::vector<std::uint8_t> c256(count);
+    std::vector<iro::rgb> gradient(count), noise(count);
+    for(std::size_t i = 0; i < count; ++i) {
+        c16[i] = static_cast<iro::color::color>((i/64)%16);
+        c256[i] = static_cast<std::uint8_t>(i/64);
+        gradient[i] = {static_cast<std::uint8_t>(i/64), static_cast<std::uint8_t>(i/128), 0};
+        noise[i] = {static_cast<std::uint8_t>(i*97), static_cast<std::uint8_t>(i*31), static_cast<std::uint8_t>(i*7)}; // changes every character, so a code is written for each one
+    }
+
+    run("16 colors, ascii",          ascii, c16);
+    run("256 colors, ascii",         ascii, c256);
+    run("rgb gradient, ascii",       ascii, gradient);
+    run("rgb gradient, utf-8",       utf8,  gradient);
+    run("rgb every character, ascii", ascii, noise);
+}
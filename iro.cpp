@@ -0,0 +1,5 @@
+// The IRO_IMPL translation unit for the iro library target (see CMakeLists.txt)
+// If you link against that target, don't define IRO_IMPL anywhere in your own code
+
+#define IRO_IMPL
+#include "iro.h"
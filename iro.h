@@ -1,18 +1,16 @@
-#pragma once
+// iro.h is split into two parts, each with its own include guard. The first part is effects and state guards, which is all you need to do
+// std::cout << iro::red << "text";
+// The second part is everything else (effect_string and all of the things built on it), which pulls in a lot more of the standard library
+// Defining IRO_LEAN before including iro.h skips the second part, which makes the include noticeably cheaper in translation units that just print with effects
+// Nothing else changes (the IRO_IMPL file always gets both parts), so translation units with and without IRO_LEAN can be mixed freely
 
-#include <array>
-#include <ostream>
-#include <sstream>
-#include <vector>
+#ifndef IRO_H_EFFECTS_AND_STATE_GUARDS
+#define IRO_H_EFFECTS_AND_STATE_GUARDS
 
-#if defined(__unix__) || defined(__unix) || defined(__APPLE__) || defined(__MACH__)
-    #define IRO_UNIX
-    #include <unistd.h>
-#elif defined(_WIN32)
-    #define IRO_WINDOWS
-    #include <cstdio>
-    #include <io.h>
-#endif
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <utility>
 
 namespace iro {
     enum effect_type {
@@ -47,96 +45,179 @@ namespace iro {
         };
     }
 
+    /// a 24 bit color, for terminals that support them
+    struct rgb {
+        std::uint8_t r, g, b;
+    };
+
+    constexpr bool operator==(const rgb& lhs, const rgb& rhs) {
+        return (lhs.r == rhs.r) && (lhs.g == rhs.g) && (lhs.b == rhs.b);
+    }
+
+    constexpr bool operator!=(const rgb& lhs, const rgb& rhs) {
+        return !(lhs == rhs);
+    }
+
+    namespace overflow { // what effect_string::print_wrapped does with text that doesn't fit on a line
+        enum overflow {
+            wrap,
+            truncate
+        };
+    }
+
 
     class effect;
     class effect_set;
 
     namespace detail {
-        effect create(const char* code, effect_type type) noexcept;
+        constexpr effect create(const char* code, effect_type type) noexcept;
     }
 
     class effect {
         const char* code_;
         effect_type type_;
 
-        effect(const char* code, effect_type type) noexcept;
+        constexpr effect(const char* code, effect_type type) noexcept : code_(code), type_(type) {}
 
-        friend effect detail::create(const char* code, effect_type type) noexcept; // Make this private so that the user can't construct invalid effects
+        friend constexpr effect detail::create(const char* code, effect_type type) noexcept; // Make this private so that the user can't construct invalid effects
         friend class effect_set;
         friend class terminal_state_guard;
 
-        friend effect_set   operator|(const effect& e, const effect_set& es);
-        friend effect_set&& operator|(const effect& e, effect_set&& es);
+        friend constexpr effect_set   operator|(const effect& e, const effect_set& es);
+        friend constexpr effect_set&& operator|(const effect& e, effect_set&& es);
     };
 
+    namespace detail {
+        constexpr effect create(const char* code, effect_type type) noexcept {
+            return {code, type};
+        }
+    }
+
+    // By default, effects are extern constants that get defined (and dynamically initialized) in the IRO_IMPL translation unit
+    // Defining IRO_CONSTEXPR_EFFECTS (in every translation unit, before including iro.h) makes them compile-time constants instead,
+    // so the compiler can see their codes at the call site and they're safe to use from other static initializers
+    #ifdef IRO_CONSTEXPR_EFFECTS
+        #if (__cplusplus >= 201703L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 201703L))
+            #define IRO_INLINE_VARIABLE inline
+        #else
+            #define IRO_INLINE_VARIABLE static // no inline variables before c++17, so every translation unit gets its own copy
+        #endif
+
+        #define IRO_EFFECT(name, code, type)  IRO_INLINE_VARIABLE constexpr effect name = detail::create(code, type)
+        #define IRO_EFFECT_ALIAS(name, other) IRO_INLINE_VARIABLE constexpr const effect& name = other
+    #elif defined(IRO_IMPL)
+        #define IRO_EFFECT(name, code, type)  extern const effect name;  const effect name = detail::create(code, type)
+        #define IRO_EFFECT_ALIAS(name, other) extern const effect& name; const effect& name = other
+    #else
+        #define IRO_EFFECT(name, code, type)  extern const effect name
+        #define IRO_EFFECT_ALIAS(name, other) extern const effect& name
+    #endif
+
     ///  effects  ///
         ///  foreground colors  ///
-            extern const effect black          ;
-            extern const effect red            ;
-            extern const effect green          ;
-            extern const effect yellow         ;
-            extern const effect blue           ;
-            extern const effect magenta        ;
-            extern const effect cyan           ;
-            extern const effect white          ;
-
-            extern const effect bright_black   ;
-                extern const effect& gray ;
-                extern const effect& grey ;
-            extern const effect bright_red     ;
-            extern const effect bright_green   ;
-            extern const effect bright_yellow  ;
-            extern const effect bright_blue    ;
-            extern const effect bright_magenta ;
-            extern const effect bright_cyan    ;
-            extern const effect bright_white   ;
+            IRO_EFFECT(black         , "\x1b[30m", foreground_color);
+            IRO_EFFECT(red           , "\x1b[31m", foreground_color);
+            IRO_EFFECT(green         , "\x1b[32m", foreground_color);
+            IRO_EFFECT(yellow        , "\x1b[33m", foreground_color);
+            IRO_EFFECT(blue          , "\x1b[34m", foreground_color);
+            IRO_EFFECT(magenta       , "\x1b[35m", foreground_color);
+            IRO_EFFECT(cyan          , "\x1b[36m", foreground_color);
+            IRO_EFFECT(white         , "\x1b[37m", foreground_color);
+
+            IRO_EFFECT(bright_black  , "\x1b[90m", foreground_color);
+                IRO_EFFECT_ALIAS(gray, bright_black);
+                IRO_EFFECT_ALIAS(grey, bright_black);
+            IRO_EFFECT(bright_red    , "\x1b[91m", foreground_color);
+            IRO_EFFECT(bright_green  , "\x1b[92m", foreground_color);
+            IRO_EFFECT(bright_yellow , "\x1b[93m", foreground_color);
+            IRO_EFFECT(bright_blue   , "\x1b[94m", foreground_color);
+            IRO_EFFECT(bright_magenta, "\x1b[95m", foreground_color);
+            IRO_EFFECT(bright_cyan   , "\x1b[96m", foreground_color);
+            IRO_EFFECT(bright_white  , "\x1b[97m", foreground_color);
         /// /foreground colors  ///
 
         ///  background colors  ///
-            extern const effect background_black          ;
-            extern const effect background_red            ;
-            extern const effect background_green          ;
-            extern const effect background_yellow         ;
-            extern const effect background_blue           ;
-            extern const effect background_magenta        ;
-            extern const effect background_cyan           ;
-            extern const effect background_white          ;
-
-            extern const effect background_bright_black   ;
-                extern const effect& background_gray ;
-                extern const effect& background_grey ;
-            extern const effect background_bright_red     ;
-            extern const effect background_bright_green   ;
-            extern const effect background_bright_yellow  ;
-            extern const effect background_bright_blue    ;
-            extern const effect background_bright_magenta ;
-            extern const effect background_bright_cyan    ;
-            extern const effect background_bright_white   ;
+            IRO_EFFECT(background_black         , "\x1b[40m",  background_color);
+            IRO_EFFECT(background_red           , "\x1b[41m",  background_color);
+            IRO_EFFECT(background_green         , "\x1b[42m",  background_color);
+            IRO_EFFECT(background_yellow        , "\x1b[43m",  background_color);
+            IRO_EFFECT(background_blue          , "\x1b[44m",  background_color);
+            IRO_EFFECT(background_magenta       , "\x1b[45m",  background_color);
+            IRO_EFFECT(background_cyan          , "\x1b[46m",  background_color);
+            IRO_EFFECT(background_white         , "\x1b[47m",  background_color);
+
+            IRO_EFFECT(background_bright_black  , "\x1b[100m", background_color);
+                IRO_EFFECT_ALIAS(background_gray, background_bright_black);
+                IRO_EFFECT_ALIAS(background_grey, background_bright_black);
+            IRO_EFFECT(background_bright_red    , "\x1b[101m", background_color);
+            IRO_EFFECT(background_bright_green  , "\x1b[102m", background_color);
+            IRO_EFFECT(background_bright_yellow , "\x1b[103m", background_color);
+            IRO_EFFECT(background_bright_blue   , "\x1b[104m", background_color);
+            IRO_EFFECT(background_bright_magenta, "\x1b[105m", background_color);
+            IRO_EFFECT(background_bright_cyan   , "\x1b[106m", background_color);
+            IRO_EFFECT(background_bright_white  , "\x1b[107m", background_color);
         /// /background colors  ///
 
         ///  font weight  ///
-            extern const effect bold          ;
-            extern const effect faint         ;
-            extern const effect normal_weight ;
+            IRO_EFFECT(bold         , "\x1b[1m",  font_weight);
+            IRO_EFFECT(faint        , "\x1b[2m",  font_weight);
+            IRO_EFFECT(normal_weight, "\x1b[22m", font_weight);
         /// /font weight  ///
 
         /// underline  ///
-            extern const effect underlined     ;
-            extern const effect not_underlined ;
+            IRO_EFFECT(underlined    , "\x1b[4m",  underlinedness);
+                IRO_EFFECT_ALIAS(underline, underlined); // I can't decide whether to call this one underlined or underlineD, so I'll just let both be valid
+            IRO_EFFECT(not_underlined, "\x1b[24m", underlinedness);
         /// /underline  ///
 
         ///  blink  ///
-            extern const effect blinking     ;
-            extern const effect not_blinking ;
+            IRO_EFFECT(blinking    , "\x1b[5m",  blink);
+            IRO_EFFECT(not_blinking, "\x1b[25m", blink);
         /// /blink  ///
 
     /// /effects  ///
 
+    #undef IRO_EFFECT
+    #undef IRO_EFFECT_ALIAS
+    #undef IRO_INLINE_VARIABLE
+
     class effect_set;
     namespace detail{
-        unsigned push_state_guard(std::ostream* stream, const effect_set& effects);
-        void set(std::ostream* stream, unsigned index, const effect_set& effects);
-        unsigned copy_state_guard(std::ostream* stream, unsigned index_in_stack);
+        struct effect_entry_t;
+
+        void push_state_guard(std::ostream* stream, effect_entry_t* entry, const effect_set& effects);
+        void set(std::ostream* stream, effect_entry_t* entry, const effect_set& effects);
+        void copy_state_guard(std::ostream* stream, const effect_entry_t* source, effect_entry_t* entry);
+
+        template<std::size_t...Is>
+        constexpr std::array<const char*, number_of_effect_types> type_to_code(std::size_t type1, const char* code1, std::size_t type2, const char* code2, std::index_sequence<Is...>) {
+            return {{((Is == type2) ? code2 : (Is == type1) ? code1 : nullptr)...}};
+        }
+
+        // an array with code1 at index type1 and code2 at index type2 (code2 wins if they're the same type). This exists because std::array can't be modified in a constant expression until c++17
+        constexpr std::array<const char*, number_of_effect_types> type_to_code(std::size_t type1, const char* code1, std::size_t type2, const char* code2) {
+            return type_to_code(type1, code1, type2, code2, std::make_index_sequence<number_of_effect_types>());
+        }
+
+        template<std::size_t...Is>
+        constexpr std::array<const char*, number_of_effect_types> with_code(const std::array<const char*, number_of_effect_types>& codes, std::size_t type, const char* code, std::index_sequence<Is...>) {
+            return {{((Is == type) ? code : codes[Is])...}};
+        }
+
+        // codes, but with code at index type
+        constexpr std::array<const char*, number_of_effect_types> with_code(const std::array<const char*, number_of_effect_types>& codes, std::size_t type, const char* code) {
+            return with_code(codes, type, code, std::make_index_sequence<number_of_effect_types>());
+        }
+
+        template<std::size_t...Is>
+        constexpr std::array<const char*, number_of_effect_types> merge_codes(const std::array<const char*, number_of_effect_types>& lhs, const std::array<const char*, number_of_effect_types>& rhs, std::index_sequence<Is...>) {
+            return {{(rhs[Is] ? rhs[Is] : lhs[Is])...}};
+        }
+
+        // every code in rhs, and the codes from lhs for the types that rhs doesn't have
+        constexpr std::array<const char*, number_of_effect_types> merge_codes(const std::array<const char*, number_of_effect_types>& lhs, const std::array<const char*, number_of_effect_types>& rhs) {
+            return merge_codes(lhs, rhs, std::make_index_sequence<number_of_effect_types>());
+        }
     }
     class effect_set {
         std::array<const char*, number_of_effect_types> type_to_code_;
@@ -144,48 +225,85 @@ namespace iro {
         friend class terminal_state_guard;
         friend class effect_string;
 
-        friend effect_set   operator|(const effect& e, const effect_set& es);
-        friend effect_set&& operator|(const effect& e, effect_set&& es);
+        friend constexpr effect_set   operator|(const effect& e, const effect_set& es);
+        friend constexpr effect_set&& operator|(const effect& e, effect_set&& es);
 
-        friend unsigned detail::push_state_guard(std::ostream* stream, const effect_set& effects);
-        friend void detail::set(std::ostream* stream, unsigned index, const effect_set& effects);
+        friend void detail::push_state_guard(std::ostream* stream, detail::effect_entry_t* entry, const effect_set& effects);
+        friend void detail::set(std::ostream* stream, detail::effect_entry_t* entry, const effect_set& effects);
 
-        friend unsigned detail::copy_state_guard(std::ostream* stream, unsigned index_in_stack);
+        friend void detail::copy_state_guard(std::ostream* stream, const detail::effect_entry_t* source, detail::effect_entry_t* entry);
 
-        effect_set(const std::array<const char*, number_of_effect_types>& type_to_code);
+        constexpr effect_set(const std::array<const char*, number_of_effect_types>& type_to_code) : type_to_code_(type_to_code) {}
 
     public:
-        effect_set();
+        constexpr effect_set() : type_to_code_{} {}
 
-        effect_set(const effect& e);
-        effect_set(const effect& e, const effect& e2);
+        constexpr effect_set(const effect& e) : type_to_code_(detail::type_to_code(e.type_, e.code_, number_of_effect_types, nullptr)) {}
+        constexpr effect_set(const effect& e, const effect& e2) : type_to_code_(detail::type_to_code(e.type_, e.code_, e2.type_, e2.code_)) {}
 
-        effect_set   operator| (const effect& rhs) const&;
-        effect_set&& operator| (const effect& rhs)&&;
-        effect_set&  operator|=(const effect& rhs)&;
-        effect_set&& operator|=(const effect& rhs)&&;
+        // these are all constexpr (and defined here instead of in the IRO_IMPL file) so that something like red|bold|underlined is folded into a constant at the call site
+        constexpr effect_set   operator| (const effect& rhs) const& {
+            return effect_set(detail::with_code(type_to_code_, rhs.type_, rhs.code_));
+        }
+        constexpr effect_set&& operator| (const effect& rhs)&& {
+            return std::move(*this |= rhs);
+        }
+        constexpr effect_set&  operator|=(const effect& rhs)& {
+            type_to_code_ = detail::with_code(type_to_code_, rhs.type_, rhs.code_); // assigning the whole array, because std::array can't be modified element by element in a constant expression until c++17
+            return *this;
+        }
+        constexpr effect_set&& operator|=(const effect& rhs)&& {
+            return std::move(*this |= rhs);
+        }
 
-        effect_set   operator| (const effect_set& rhs) const&;
-        effect_set&& operator| (const effect_set& rhs)&&;
-        effect_set&  operator|=(const effect_set& rhs)&;
-        effect_set&& operator|=(const effect_set& rhs)&&;
+        constexpr effect_set   operator| (const effect_set& rhs) const& {
+            return effect_set(detail::merge_codes(type_to_code_, rhs.type_to_code_));
+        }
+        constexpr effect_set&& operator| (const effect_set& rhs)&& {
+            return std::move(*this |= rhs); // avoids creating unnecessary temporaries
+        }
+        constexpr effect_set&  operator|=(const effect_set& rhs)& {
+            type_to_code_ = detail::merge_codes(type_to_code_, rhs.type_to_code_);
+            return *this;
+        }
+        constexpr effect_set&& operator|=(const effect_set& rhs)&& {
+            return std::move(*this |= rhs);
+        }
     };
 
-    effect_set   operator|(const effect& e1, const effect& e2);
-    effect_set   operator|(const effect& e, const effect_set& es);
-    effect_set&& operator|(const effect& e, effect_set&& es);
+    constexpr effect_set operator|(const effect& e1, const effect& e2) {
+        return {e1, e2};
+    }
+
+    constexpr effect_set operator|(const effect& e, const effect_set& es) { // es wins if it already has an effect of e's type
+        return es.type_to_code_[e.type_] ? es : es|e;
+    }
+
+    constexpr effect_set&& operator|(const effect& e, effect_set&& es) {
+        return static_cast<const effect_set&>(es).type_to_code_[e.type_] ? std::move(es) : std::move(es |= e); // the non-const operator[] isn't constexpr until c++17
+    }
 
 
     namespace detail {
-        unsigned push_state_guard(std::ostream* stream, effect_type type, const char* code);
-        unsigned push_empty_state_guard(std::ostream* stream); // TODO: change all instances of effect in function names to state guard, because now all effects are bundled into one entry in the stack
+        void push_state_guard(std::ostream* stream, effect_entry_t* entry, effect_type type, const char* code);
+        void push_empty_state_guard(std::ostream* stream, effect_entry_t* entry); // TODO: change all instances of effect in function names to state guard, because now all effects are bundled into one entry in the stack
         void pop_effect(std::ostream* stream);
-        void delete_state_guard(std::ostream* stream, unsigned index_in_stack);
-        void set(std::ostream* stream, unsigned index, effect_type type, const char* code);
+        void delete_state_guard(std::ostream* stream, effect_entry_t* entry);
+        void move_state_guard(effect_entry_t* from, effect_entry_t* to);
+        void swap_state_guards(effect_entry_t* a, effect_entry_t* b);
+        void set(std::ostream* stream, effect_entry_t* entry, effect_type type, const char* code);
         void set_top(std::ostream* stream, effect_type type, const char* code);
         const char* get_top_code(const std::ostream* stream, effect_type type);
+        const char* get_top_state_code(const std::ostream* stream); // one escape code that sets every effect type to its top code
         void reapply_top(std::ostream* stream, effect_type type);
-        bool state_guard_has_effect_of_type(std::ostream* stream, unsigned index, effect_type type);
+        bool state_guard_has_effect_of_type(const effect_entry_t* entry, effect_type type);
+        std::uint64_t state_generation(const std::ostream* stream); // changes whenever the codes at the top of stream's stack might have changed
+
+        unsigned display_width(char32_t code_point);
+        constexpr unsigned tab_width = 8; // a tab moves to the next multiple of this many columns
+        const char* escape_code_end(const char* c, const char* end); // nullptr if c isn't the start of an escape code
+        unsigned utf8_length(const char* c, const char* end);
+        const char* next_character(const char* c, const char* end, unsigned& width);
 
         template<typename T>
         struct filled_array_helper_t {
@@ -219,19 +337,39 @@ namespace iro {
             arr[index] = set_value;
             return arr;
         }
+
+        struct stream_stack_t;
+
+        // one entry in a stream's stack of state guards
+        // entries live inside the terminal_state_guards themselves and are linked together intrusively, so pushing and popping a state guard never allocates
+        struct effect_entry_t {
+            std::array<const char*, number_of_effect_types> type_to_code;
+            bool is_empty = false; // I'm not a huge fan of there being two distinct empty states, but I can't think of another way to implement the behavior I want
+
+            std::array<const char*, number_of_effect_types> state; // the code that's in effect for each effect type when this entry is the top of the stack. Kept up to date by set, so looking up the top code never has to walk the stack
+            char state_code[32];                                   // all of state combined into one escape code, so the terminal can be restored to this entry's state with one write
+
+            stream_stack_t* stack = nullptr;  // nullptr means this entry isn't in any stack (e.g. it belongs to a moved-from state guard)
+            effect_entry_t* below = nullptr;
+            effect_entry_t* above = nullptr;  // nullptr means this entry is the top of its stack
+
+            static effect_entry_t create_empty() {
+                return {filled_array<const char*>(nullptr), true, {}, {}}; // state and state_code are filled in when the entry is pushed
+            }
+        };
     }
 
 
     class effect_string;
+    class cached_effect_string;
 
     class terminal_state_guard {
-        unsigned location_in_stack_;            // 0 is a special value that indicates a state guard with no active effects
-        std::ostream* stream_ = nullptr;        // 0 is always available because index 0 (the first element in the stack) is always the default effect set
-
-        static constexpr unsigned empty_state_guard_location = 0;
+        detail::effect_entry_t entry_;   // this state guard's entry in its stream's stack. Moving the state guard relinks the entry, so it never needs to be stored anywhere else
+        std::ostream* stream_ = nullptr;
 
         friend terminal_state_guard   operator<<(std::ostream&, const effect_string&);
         friend terminal_state_guard&& operator<<(terminal_state_guard&, const effect_string&);
+        friend terminal_state_guard&& operator<<(terminal_state_guard&, const cached_effect_string&);
 
     public:
         terminal_state_guard() = delete;
@@ -269,18 +407,154 @@ namespace iro {
 
     terminal_state_guard operator<<(std::ostream& stream, const effect& e);
     terminal_state_guard operator<<(std::ostream& stream, const effect_set& e);
+}
+
+#endif // #ifndef IRO_H_EFFECTS_AND_STATE_GUARDS
+
 
+#if (!defined(IRO_LEAN) || defined(IRO_IMPL)) && !defined(IRO_H_EVERYTHING_ELSE)
+#define IRO_H_EVERYTHING_ELSE
+
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+namespace iro {
+    /**
+     * Where an effect_string gets its memory from
+     *
+     * This is basically std::pmr::memory_resource, which isn't available in C++14
+     * A memory_resource has to outlive every effect_string that allocates from it (including copies)
+     */
+    class memory_resource {
+    public:
+        virtual ~memory_resource() = default;
+
+        virtual void* allocate(std::size_t bytes, std::size_t alignment) = 0;
+        virtual void deallocate(void* p, std::size_t bytes, std::size_t alignment) = 0;
+    };
+
+    /// the memory_resource that effect_strings use when you don't give them one. Just calls new and delete
+    memory_resource* default_memory_resource();
+
+    /**
+     * A memory_resource that hands out memory from big blocks and never frees anything until it's released (or destroyed)
+     *
+     * Good for things like building up output for one request, and then throwing it all away at once
+     * Not thread safe
+     */
+    class arena : public memory_resource {
+        struct block_t {
+            block_t* next;
+        };
+
+        block_t* blocks_ = nullptr;
+        char* current_ = nullptr; // free space in the newest block
+        char* end_     = nullptr;
+        std::size_t block_size_;
+
+    public:
+        explicit arena(std::size_t block_size = 4096);
+
+        arena           (const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        void* allocate(std::size_t bytes, std::size_t alignment) override;
+        void deallocate(void* p, std::size_t bytes, std::size_t alignment) override; // does nothing
+
+        /// frees every block. Anything allocated from this arena can't be used anymore after this
+        void release();
+
+        ~arena() override;
+    };
+
+    namespace detail {
+        // lets standard containers allocate from a memory_resource
+        template<typename T>
+        struct resource_allocator {
+            using value_type = T;
+
+            // the allocator goes wherever the container's contents go, so an effect_string that's assigned to always ends up allocating from the same resource as the one it was assigned from
+            using propagate_on_container_copy_assignment = std::true_type;
+            using propagate_on_container_move_assignment = std::true_type;
+            using propagate_on_container_swap            = std::true_type;
+
+            memory_resource* resource;
+
+            resource_allocator(memory_resource* resource) : resource(resource) {}
+
+            template<typename U>
+            resource_allocator(const resource_allocator<U>& other) : resource(other.resource) {}
+
+            T* allocate(std::size_t n) {
+                return static_cast<T*>(resource->allocate(n*sizeof(T), alignof(T)));
+            }
+
+            void deallocate(T* p, std::size_t n) {
+                resource->deallocate(p, n*sizeof(T), alignof(T));
+            }
+        };
+
+        template<typename T, typename U>
+        bool operator==(const resource_allocator<T>& lhs, const resource_allocator<U>& rhs) {
+            return lhs.resource == rhs.resource;
+        }
+
+        template<typename T, typename U>
+        bool operator!=(const resource_allocator<T>& lhs, const resource_allocator<U>& rhs) {
+            return lhs.resource != rhs.resource;
+        }
+    }
+
+
+    namespace detail {
+        // once an effect_string has accumulated this many characters, they get sealed into an immutable chunk
+        // chunks are shared (not copied) when effect_strings are copied or concatenated, so building a large effect_string piece by piece takes linear time
+        constexpr std::size_t effect_string_chunk_size = 4096;
+
+        // a snapshot of the codes at the top of a stream's stack, so that rendering an effect_string doesn't have to look them up for every piece
+        struct top_codes_t {
+            std::array<const char*, number_of_effect_types> type_to_code;
+            const char* state_code; // sets every effect type at once
+
+            explicit top_codes_t(const std::ostream& stream);
+
+            // the code that ends a piece of text with these effects: the top code of its type if it only has one, otherwise state_code. nullptr if it has none
+            // every renderer ends pieces this way, so they all produce the same bytes
+            const char* end_code(const std::array<const char*, number_of_effect_types>& effects) const;
+        };
+    }
 
     class effect_string {
+        using string_t = std::basic_string<char, std::char_traits<char>, detail::resource_allocator<char>>;
+
         struct string_and_effects {
-            std::string string;
-            std::array<bool, number_of_effect_types> active_effects;
+            string_t string;                                          // just the text. The codes are kept separately so that the text can be measured and split without parsing escape codes
+            std::array<const char*, number_of_effect_types> type_to_code; // nullptr means the string doesn't have an effect of that type
 
-            inline string_and_effects() {
-                active_effects.fill(false);
+            inline string_and_effects(memory_resource* resource) : string(resource) {
+                type_to_code.fill(nullptr);
             }
         };
-        std::vector<string_and_effects> strings_;
+        using strings_t = std::vector<string_and_effects, detail::resource_allocator<string_and_effects>>;
+
+        // The chunks form a linked list that goes from back to front. Nothing in it ever changes after it's made,
+        // so copying an effect_string only copies the pointer to its last chunk, and appending to the copy leaves the original alone
+        struct chunk_t {
+            std::shared_ptr<chunk_t> previous;
+            std::shared_ptr<const strings_t> strings; // sealed strings. A pointer, so that concatenating effect_strings can share them too
+            std::size_t count;                        // the number of chunks in the list, counting this one
+
+            chunk_t(std::shared_ptr<chunk_t> previous, std::shared_ptr<const strings_t> strings);
+            ~chunk_t();
+        };
+
+        memory_resource* resource_;                 // everything below (and all the chunks) is allocated from here
+        std::shared_ptr<chunk_t> last_chunk_;
+        strings_t strings_;                         // strings that come after all the chunks and haven't been sealed yet
+        std::size_t strings_size_ = 0;              // number of characters in strings_. Always less than detail::effect_string_chunk_size between calls
 
         template<typename T>
         void init_(std::stringstream& stream, const T& arg) {
@@ -293,52 +567,76 @@ namespace iro {
             init_(stream, args...);
         }
 
+        std::vector<const chunk_t*> chunks_() const; // front to back
+
+        template<typename F>
+        void for_each_string_(F&& f) const {
+            if(last_chunk_) {
+                for(auto chunk : chunks_()) {
+                    for(const auto& string : *chunk->strings) {
+                        f(string);
+                    }
+                }
+            }
+            for(const auto& string : strings_) {
+                f(string);
+            }
+        }
+
         friend terminal_state_guard   operator<<(std::ostream&, const effect_string&);
         friend terminal_state_guard&& operator<<(terminal_state_guard&, const effect_string&);
+        friend class parallel_render;
+        friend class journal_writer;
+        friend class journal_reader;
 
         string_and_effects& back_();
         const string_and_effects& back_() const;
 
+        void append_(string_and_effects&& se); // merges se into the last string if they have the same effects
+        void append_chunks_(const effect_string& other);
+        void seal_();
+
     public:
+        effect_string();
+
+        /// an empty effect_string that allocates from resource
+        explicit effect_string(memory_resource& resource);
+
         /// concatenates arg and args... and applies effects to the resulting string
         template<typename T, typename...Ts>
-        effect_string(const effect_set& effects, const T& arg, const Ts&...args) {
+        effect_string(const effect_set& effects, const T& arg, const Ts&...args) : effect_string(*default_memory_resource(), effects, arg, args...) {}
+
+        /// same as above, but allocates from resource
+        template<typename T, typename...Ts>
+        effect_string(memory_resource& resource, const effect_set& effects, const T& arg, const Ts&...args) : effect_string(resource) {
             std::stringstream stream; // probably really slow
-            for(unsigned i = 0; i < effects.type_to_code_.size(); ++i) {
-                const auto& e = effects.type_to_code_[i];
-                if(e) {
-                    strings_.resize(1);
-                    stream << e;
-                    strings_.back().active_effects[i] = true;
-                }
-            }
+            string_and_effects se(resource_);
+            se.type_to_code = effects.type_to_code_;
             init_(stream, arg, args...);
-            strings_.back().string = stream.str();
+            const auto& string = stream.str();
+            se.string.assign(string.data(), string.size());
+
+            append_(std::move(se));
         }
 
-        template<typename T, std::enable_if_t<(!std::is_same<T, effect_string>::value), bool> = true>
-        effect_string& operator<<(T& arg) {
-            back_() += arg;
-            return *this;
+        template<typename T, std::enable_if_t<(!std::is_same<std::decay_t<T>, effect_string>::value), bool> = true>
+        effect_string& operator<<(T&& arg) {
+            return (*this += std::forward<T>(arg));
         }
         effect_string& operator<<(const effect_string& arg);
         effect_string& operator<<(effect_string&& arg);
 
-        template<typename T, std::enable_if_t<(!std::is_same<T, effect_string>::value), bool> = true>
+        template<typename T, std::enable_if_t<(!std::is_same<std::decay_t<T>, effect_string>::value), bool> = true>
         effect_string& operator+=(T&& arg) {
 
             std::stringstream sstream;
             sstream << std::forward<T>(arg);
 
-            if(back_().active_effects == detail::filled_array<number_of_effect_types>(false)) {
-                back_().string += sstream.str();
-            }
-            else {
-                string_and_effects se;
-                se.string = sstream.str();
+            string_and_effects se(resource_);
+            const auto& string = sstream.str();
+            se.string.assign(string.data(), string.size());
 
-                strings_.push_back(std::move(se));
-            }
+            append_(std::move(se));
 
             return *this;
         }
@@ -348,7 +646,7 @@ namespace iro {
 
         template<typename T>
         effect_string operator+(T&& arg) const& {
-            auto ret = *this;
+            auto ret = *this; // only copies the unsealed strings. The chunks are shared
             ret += std::forward<T>(arg);
             return ret;
         }
@@ -371,6 +669,22 @@ namespace iro {
          * @param stream the stream you will eventually print this string to (THIS IS A PROMISE! DO NOT BREAK IT!)
          */
         std::string unsafe_string(const std::ostream& stream) const;
+
+        /**
+         * Prints this string to stream so that no line is wider than width columns
+         *
+         * When a line break is inserted in the middle of a string with effects, only that string's effects are ended before the break and restarted after it,
+         * so nothing bleeds into whatever is drawn at the edge of the terminal
+         * Width is measured in display columns (wide characters count as 2, combining characters, escape codes and control characters count as 0,
+         * and a tab moves to the next multiple of 8 columns, like it does in a terminal)
+         *
+         * @param behavior whether text past the end of a line gets wrapped onto the next line or cut off
+         * @param first_line the first (wrapped) line to print. Together with line_count, this lets you print one page at a time
+         * @param line_count the maximum number of lines to print
+         * @return the total number of lines in the wrapped string, including the ones that weren't printed
+         */
+        std::size_t print_wrapped(std::ostream& stream, unsigned width, overflow::overflow behavior = overflow::wrap,
+                                  std::size_t first_line = 0, std::size_t line_count = std::size_t(-1)) const;
     };
 
     /// does the exact same thing as the constructor of effect_string. Just has a nicer name
@@ -381,216 +695,426 @@ namespace iro {
 
     terminal_state_guard   operator<<(std::ostream& os, const effect_string& es);
     terminal_state_guard&& operator<<(terminal_state_guard& p, const effect_string& es);
+
+    /**
+     * Prints text with every character in its own color. Useful for gradients, heatmaps, etc.
+     *
+     * There must be one color for each (UTF-8) character in text. Escape codes that are already in text are copied as they are, and don't use up a color
+     * An escape code is only written when the color changes, and the color is reset to whatever the stream's current color is at the end
+     * The 256 color overload takes palette indices, and the rgb overload uses 24 bit color. Both need a terminal that supports them
+     *
+     * @param color_count the number of elements in colors. If there are fewer colors than characters, the last color is used for the rest (and debug builds assert)
+     * @param type foreground_color or background_color
+     */
+    void print_colored(std::ostream& stream, const std::string& text, const color::color* colors, std::size_t color_count, effect_type type = foreground_color);
+    void print_colored(std::ostream& stream, const std::string& text, const std::uint8_t* colors, std::size_t color_count, effect_type type = foreground_color);
+    void print_colored(std::ostream& stream, const std::string& text, const rgb* colors,          std::size_t color_count, effect_type type = foreground_color);
+
+    /**
+     * An effect_string that remembers the last thing it rendered to
+     *
+     * Printing an effect_string has to look up the current effects of the stream and build the escape codes from scratch every time.
+     * If you print the same string over and over (like an "[ERROR]" prefix), this does that once and then reuses the result
+     * until a state guard changes what's at the top of the stream's stack, or until it gets printed to a different stream
+     */
+    class cached_effect_string {
+        effect_string string_;
+
+        mutable std::string rendered_;
+        mutable const std::ostream* rendered_stream_ = nullptr;
+        mutable std::uint64_t rendered_generation_ = 0;
+
+    public:
+        cached_effect_string(effect_string es);
+
+        const effect_string& string() const;
+
+        /// same as string().unsafe_string(stream) (and just as unsafe), but only renders again if something has changed since last time
+        const std::string& unsafe_string(const std::ostream& stream) const;
+    };
+
+    std::ostream&          operator<<(std::ostream& os, const cached_effect_string& ces); // every effect in the string is reset inside the string, so there's no need to push a state guard
+    terminal_state_guard&& operator<<(terminal_state_guard& p, const cached_effect_string& ces);
+
+    /**
+     * Copies output from a file descriptor (like a pipe connected to a child process's stdout) to stream, with a styled prefix at the start of every line
+     *
+     * Data is read in big blocks and only whole lines are written (unless a line doesn't fit in the buffer),
+     * so the lines of several relays printing to the same stream don't get mixed together
+     * Escape codes that the child writes stay inside iro's state: resets (like \x1b[0m or \x1b[39m) go back to stream's current effects instead of the terminal's defaults,
+     * and effects that the child still has on at the end of a line are ended before the newline and started again after the next prefix, so they never bleed into the prefix or anything else
+     */
+    class line_relay {
+        std::ostream& stream_;
+        cached_effect_string prefix_;
+
+        std::unique_ptr<char[]> buffer_;
+        std::size_t capacity_;
+        std::size_t size_ = 0; // bytes in buffer_ that have been read but not written (the start of an unfinished line)
+
+        std::string out_;           // what gets written. Reused, so relaying doesn't allocate once it's big enough
+        bool at_line_start_ = true;
+
+        // the parameters of each code the child currently has on (empty means off), indexed by effect type
+        // The 4 after iro's effect types are italic, inverse, hidden and crossed out, which iro doesn't have effects for
+        std::array<std::string, number_of_effect_types+4> child_codes_;
+
+        const char* rewrite_escape_code_(const char* c, const char* end);
+        void start_child_codes_();
+        void end_child_codes_();
+        void write_(const char* begin, const char* end);
+
+    public:
+        /**
+         * @param prefix printed at the start of every line. It's only rendered again when stream's effects change
+         * @param buffer_size the most that's read at once. Lines longer than this get written in pieces
+         */
+        line_relay(std::ostream& stream, effect_string prefix, std::size_t buffer_size = 65536);
+
+        /**
+         * Reads from fd once (blocking if nothing is available, unless fd is nonblocking) and writes every line that's been finished to stream
+         *
+         * At the end of the file, whatever is left of an unfinished line is written too
+         * Throws std::system_error if reading fails. If fd is nonblocking, only call this when there's something to read (e.g. after poll says so)
+         *
+         * @return the number of bytes read. 0 means the end of the file
+         */
+        std::size_t relay(int fd);
+    };
+
+    /**
+     * Writes effect_strings to a compact, append-only binary log, so they can be rendered later (see journal_reader)
+     *
+     * Each distinct combination of effects is written once and then referred to by a small id, and text is stored as-is,
+     * so a journal is usually much smaller than the same output with escape codes, and nothing is lost like it would be if you stripped them out
+     *
+     * The stream should be opened in binary mode. The constructor writes a header that starts a new session
+     * To keep adding to an existing journal (like after a restart), open it in append mode. The new session gets its own set ids, and journal_reader reads every session as one journal
+     */
+    class journal_writer {
+        std::ostream& out_;
+        std::vector<std::array<const char*, number_of_effect_types>> sets_; // index+1 is the id. 0 means no effects
+
+        std::uint64_t set_id_(const std::array<const char*, number_of_effect_types>& type_to_code);
+
+    public:
+        explicit journal_writer(std::ostream& out);
+
+        /// writes es as one record
+        void append(const effect_string& es);
+    };
+
+    /**
+     * Reads a journal written by journal_writer
+     *
+     * Opening a journal only reads the small header in front of each record, so records can then be read in any order
+     * in must be seekable, and opened in binary mode
+     */
+    class journal_reader {
+        std::istream& in_;
+        struct record_t {
+            std::istream::pos_type position; // where the record's text starts
+            std::uint64_t size;
+            std::size_t first_set;           // the set ids in this record start counting from here in sets_, because every session numbers its sets from 1
+            std::size_t sets_end;            // the size of sets_ when this record was read. Sets after this (from later in the session, or from later sessions) can't be in it
+        };
+
+        std::vector<record_t> records_;
+        std::deque<std::array<std::string, number_of_effect_types>> set_codes_; // a deque so that the strings (and the pointers to them in sets_) never move
+        std::vector<std::array<const char*, number_of_effect_types>> sets_;
+        std::istream::pos_type end_;                                            // where to start looking for more records
+        std::size_t session_first_set_ = 0;                                     // index in sets_ of the first set of the newest session
+
+        template<typename F>
+        void read_record_(std::size_t index, F&& f) const;
+
+    public:
+        /// throws std::runtime_error if in isn't a journal
+        explicit journal_reader(std::istream& in);
+
+        /// looks for records that have been appended since the journal was opened (or refresh was last called), and returns the new number of records
+        std::size_t refresh();
+
+        /// the number of records
+        std::size_t size() const;
+
+        /// the record at index as an effect_string, ready to be printed through iro's stack. It refers to this journal_reader, so it must not outlive it
+        effect_string record(std::size_t index) const;
+
+        /// just the text of the record at index, without any effects
+        std::string plain_text(std::size_t index) const;
+    };
+
+    #ifdef IRO_PARALLEL_RENDER
+        // parallel_render is the only thing in iro that uses threads, so it's opt-in. Otherwise the IRO_IMPL file would make every program that uses iro link against the thread library
+        // Define IRO_PARALLEL_RENDER in every translation unit that uses it, and in the IRO_IMPL file
+
+        /**
+         * Renders a range of effect_strings on multiple threads, producing the same bytes as printing them to stream one after another
+         *
+         * The constructor snapshots the stream's current effects and measures every string, so size() is known before anything is written.
+         * That means the output can be written straight into a preallocated buffer, like a memory-mapped file
+         *
+         * Like unsafe_string, this embeds escape codes as character data, so don't modify any iro state for stream between constructing this and printing the output
+         */
+        class parallel_render {
+            detail::top_codes_t top_codes_;
+            const effect_string* first_;
+            std::vector<std::size_t> offsets_; // offsets_[i] is where string i starts in the output. There's one extra element at the end holding the total size
+            unsigned thread_count_;
+
+            std::size_t rendered_size_(const effect_string& es) const;
+            void render_(const effect_string& es, char* out) const;
+
+        public:
+            /// @param thread_count the number of threads to use. 0 means std::thread::hardware_concurrency()
+            parallel_render(const std::ostream& stream, const effect_string* first, const effect_string* last, unsigned thread_count = 0);
+
+            /// the number of bytes that write() will write
+            std::size_t size() const;
+
+            /// buffer must have room for at least size() bytes. Nothing is null-terminated
+            void write(char* buffer) const;
+
+            std::string str() const;
+        };
+    #endif
+
+    #ifdef IRO_TRACE
+        // When IRO_TRACE is defined (in the IRO_IMPL file), every push, set, copy and delete of a state guard is recorded in a ring buffer
+        // that holds the last IRO_TRACE_CAPACITY events (65536 by default)
+        // Call sites are recorded as return addresses, so use something like addr2line to turn them into file names and line numbers
+        // (for position independent executables, subtract the address the executable was loaded at first)
+        // The functions that record call sites are never inlined while tracing, but if the function that called them gets inlined into its own caller
+        // (which is more likely with link time optimization), the call site will point to that caller instead
+
+        /// writes the recorded events in the Chrome trace event format. Open the result in chrome://tracing or https://ui.perfetto.dev
+        void write_chrome_trace(std::ostream& out);
+
+        /// throws away all recorded events
+        void clear_trace();
+    #endif
 }
 
 #ifdef IRO_IMPL
+    #if defined(__unix__) || defined(__unix) || defined(__APPLE__) || defined(__MACH__)
+        #define IRO_UNIX
+        #include <unistd.h>
+    #elif defined(_WIN32)
+        #define IRO_WINDOWS
+        #include <cstdio>
+        #include <io.h>
+    #endif
+
+    #include <algorithm>
     #include <cassert>
+    #include <cerrno>
+    #include <cstring>
+    #include <iostream>
+    #include <stdexcept>
+    #include <system_error>
     #include <unordered_map>
 
-    namespace iro {
-        effect::effect(const char* code, effect_type type) noexcept : code_(code), type_(type) {}
-        
-        ///  effects  ///
-            ///  foreground colors  ///
-                const effect black          = detail::create("\x1b[30m", foreground_color);
-                const effect red            = detail::create("\x1b[31m", foreground_color);
-                const effect green          = detail::create("\x1b[32m", foreground_color);
-                const effect yellow         = detail::create("\x1b[33m", foreground_color);
-                const effect blue           = detail::create("\x1b[34m", foreground_color);
-                const effect magenta        = detail::create("\x1b[35m", foreground_color);
-                const effect cyan           = detail::create("\x1b[36m", foreground_color);
-                const effect white          = detail::create("\x1b[37m", foreground_color);
-    
-                const effect bright_black   = detail::create("\x1b[90m", foreground_color);
-                    const effect& gray = bright_black;
-                    const effect& grey = bright_black;
-                const effect bright_red     = detail::create("\x1b[91m", foreground_color);
-                const effect bright_green   = detail::create("\x1b[92m", foreground_color);
-                const effect bright_yellow  = detail::create("\x1b[93m", foreground_color);
-                const effect bright_blue    = detail::create("\x1b[94m", foreground_color);
-                const effect bright_magenta = detail::create("\x1b[95m", foreground_color);
-                const effect bright_cyan    = detail::create("\x1b[96m", foreground_color);
-                const effect bright_white   = detail::create("\x1b[97m", foreground_color);
-            /// /foreground colors  ///
-    
-            ///  background colors  ///
-                const effect background_black          = detail::create("\x1b[40m",  background_color);
-                const effect background_red            = detail::create("\x1b[41m",  background_color);
-                const effect background_green          = detail::create("\x1b[42m",  background_color);
-                const effect background_yellow         = detail::create("\x1b[43m",  background_color);
-                const effect background_blue           = detail::create("\x1b[44m",  background_color);
-                const effect background_magenta        = detail::create("\x1b[45m",  background_color);
-                const effect background_cyan           = detail::create("\x1b[46m",  background_color);
-                const effect background_white          = detail::create("\x1b[47m",  background_color);
-    
-                const effect background_bright_black   = detail::create("\x1b[100m", background_color);
-                    const effect& background_gray = bright_black;
-                    const effect& background_grey = bright_black;
-                const effect background_bright_red     = detail::create("\x1b[101m", background_color);
-                const effect background_bright_green   = detail::create("\x1b[102m", background_color);
-                const effect background_bright_yellow  = detail::create("\x1b[103m", background_color);
-                const effect background_bright_blue    = detail::create("\x1b[104m", background_color);
-                const effect background_bright_magenta = detail::create("\x1b[105m", background_color);
-                const effect background_bright_cyan    = detail::create("\x1b[106m", background_color);
-                const effect background_bright_white   = detail::create("\x1b[107m", background_color);
-            /// /background colors  ///
-    
-            ///  font weight  ///
-                const effect bold          = detail::create("\x1b[1m",  font_weight);
-                const effect faint         = detail::create("\x1b[2m",  font_weight);
-                const effect normal_weight = detail::create("\x1b[22m", font_weight);
-            /// /font weight  ///
-    
-            /// underline  ///
-                const effect underlined     = detail::create("\x1b[4m",  underlinedness);
-                    const effect& underline = underlined; // I can't decide whether to call this one underlined or underlineD, so I'll just let both be valid
-                const effect not_underlined = detail::create("\x1b[24m", underlinedness);
-            /// /underline  ///
-    
-            ///  blink  ///
-                const effect blinking     = detail::create("\x1b[5m",  blink);
-                const effect not_blinking = detail::create("\x1b[25m", blink);
-            /// /blink  ///
-    
-        /// /effects  ///
-
-        effect_set::effect_set(const std::array<const char*, number_of_effect_types>& type_to_code) : type_to_code_(type_to_code) {}
-
-        effect_set::effect_set() {
-            type_to_code_.fill(nullptr);
-        }
-
-        effect_set::effect_set(const effect& e) {
-            type_to_code_.fill(nullptr);
-            type_to_code_[e.type_] = e.code_;
-        }
-
-        effect_set::effect_set(const effect& e1, const effect& e2) {
-            type_to_code_.fill(nullptr);
-            type_to_code_[e1.type_] = e1.code_;
-            type_to_code_[e2.type_] = e2.code_;
-        }
-
-        effect_set effect_set::operator|(const effect& rhs) const& {
-            effect_set ret = *this;
-            ret.type_to_code_[rhs.type_] = rhs.code_;
-
-            return ret;
-        }
+    #ifdef IRO_PARALLEL_RENDER
+        #include <thread>
+    #endif
+
+    #ifdef IRO_TRACE
+        #include <chrono>
+        #include <cstdio>
+
+        #ifndef IRO_TRACE_CAPACITY
+            #define IRO_TRACE_CAPACITY 65536
+        #endif
+
+        #if defined(_MSC_VER)
+            #include <intrin.h>
+            #define IRO_RETURN_ADDRESS _ReturnAddress()
+        #elif defined(__GNUC__)
+            #define IRO_RETURN_ADDRESS __builtin_return_address(0)
+        #else
+            #define IRO_RETURN_ADDRESS nullptr
+        #endif
+
+        // the return address is only the user's call site if the function that reads it doesn't get inlined, so every function that uses IRO_TRACE_CALL_SITE is marked with this
+        #if defined(_MSC_VER)
+            #define IRO_TRACE_ENTRY_POINT __declspec(noinline)
+        #elif defined(__GNUC__)
+            #define IRO_TRACE_ENTRY_POINT __attribute__((noinline))
+        #else
+            #define IRO_TRACE_ENTRY_POINT
+        #endif
+
+        #define IRO_TRACE_CALL_SITE()         detail::trace_call_site_t iro_trace_call_site_(IRO_RETURN_ADDRESS)
+        #define IRO_TRACE_SCOPE(type, stream) detail::trace_scope_t iro_trace_scope_(detail::type, stream)
+    #else
+        #define IRO_TRACE_ENTRY_POINT
+        #define IRO_TRACE_CALL_SITE()
+        #define IRO_TRACE_SCOPE(type, stream)
+    #endif
 
-        effect_set&& effect_set::operator|(const effect& rhs)&& {
-            return std::move(*this |= rhs);
-        }
+    namespace iro {
+        #ifdef IRO_TRACE
+            namespace detail {
+                enum trace_event_type {
+                    trace_push,
+                    trace_set,
+                    trace_copy,
+                    trace_delete
+                };
+
+                struct trace_event_t {
+                    trace_event_type type;
+                    const std::ostream* stream;
+                    const void* call_site;
+                    std::uint64_t start;    // nanoseconds
+                    std::uint64_t duration; // nanoseconds
+                    std::uint32_t depth;    // size of the stream's stack after the event
+                    std::uint32_t bytes;    // number of bytes of escape codes written
+                };
+
+                static std::array<trace_event_t, IRO_TRACE_CAPACITY> trace_events_;
+                static std::uint64_t trace_event_count_ = 0; // total number of events ever recorded. trace_events_[trace_event_count_ % IRO_TRACE_CAPACITY] is the next one to be overwritten
+                static std::uint64_t trace_bytes_ = 0;       // total number of bytes written by write_code
+                static const void* trace_call_site_ = nullptr;
+                static unsigned trace_nesting_ = 0;
+
+                std::size_t stack_depth(const std::ostream* stream);
+
+                std::uint64_t trace_now() {
+                    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+                }
 
-        effect_set& effect_set::operator|=(const effect& rhs)& {
-            type_to_code_[rhs.type_] = rhs.code_;
+                // remembers where the user called into iro from. Only the outermost one counts, because the others would just point to somewhere inside iro
+                struct trace_call_site_t {
+                    bool is_outermost;
 
-            return *this;
-        }
+                    trace_call_site_t(const void* call_site) : is_outermost(!trace_call_site_) {
+                        if(is_outermost) {
+                            trace_call_site_ = call_site;
+                        }
+                    }
 
-        effect_set&& effect_set::operator|=(const effect& rhs)&& {
-            return std::move(*this|=rhs);
-        }
+                    ~trace_call_site_t() {
+                        if(is_outermost) {
+                            trace_call_site_ = nullptr;
+                        }
+                    }
+                };
 
-        effect_set effect_set::operator|(const effect_set& rhs) const& {
-            effect_set ret;
-            ret |= rhs;
-            return ret;
-        }
+                // records one event when it goes out of scope. Nested scopes (like the set inside a push) are folded into the outermost one
+                struct trace_scope_t {
+                    trace_event_type type;
+                    const std::ostream* stream;
+                    std::uint64_t start;
+                    std::uint64_t start_bytes;
 
-        effect_set&& effect_set::operator|(const effect_set& rhs)&& {
-            return std::move(*this |= rhs); // avoids creating unnecessary temporaries
-        }
+                    trace_scope_t(trace_event_type type, const std::ostream* stream) : type(type), stream(stream), start(trace_now()), start_bytes(trace_bytes_) {
+                        ++trace_nesting_;
+                    }
 
-        effect_set& effect_set::operator|=(const effect_set& rhs)& {
-            for(unsigned i = 0; i < rhs.type_to_code_.size(); ++i) {
-                const auto& e = rhs.type_to_code_[i];
-                if(e) {
-                    type_to_code_[i] = e;
-                }
+                    ~trace_scope_t() {
+                        if(--trace_nesting_ == 0) {
+                            trace_events_[trace_event_count_ % IRO_TRACE_CAPACITY] = {type, stream, trace_call_site_, start, trace_now()-start,
+                                                                                       static_cast<std::uint32_t>(stack_depth(stream)), static_cast<std::uint32_t>(trace_bytes_-start_bytes)};
+                            ++trace_event_count_;
+                        }
+                    }
+                };
             }
 
-            return *this;
-        }
+            void write_chrome_trace(std::ostream& out) {
+                static const char* names[] = {"push", "set", "copy", "delete"};
 
-        effect_set&& effect_set::operator|=(const effect_set& rhs)&& {
-            return std::move(*this |= rhs);
-        }
+                std::vector<const std::ostream*> streams; // each stream gets its own row (thread id) in the viewer
 
-        effect_set operator|(const effect& e1, const effect& e2) {
-            return {e1, e2};
-        }
+                out << "{\"traceEvents\":[";
+                std::uint64_t first = (detail::trace_event_count_ > IRO_TRACE_CAPACITY) ? detail::trace_event_count_-IRO_TRACE_CAPACITY : 0;
+                for(std::uint64_t i = first; i < detail::trace_event_count_; ++i) {
+                    const auto& event = detail::trace_events_[i % IRO_TRACE_CAPACITY];
 
-        effect_set operator|(const effect& e, const effect_set& es) {
-            if(es.type_to_code_[e.type_]) {
-                return std::move(es);
-            }
-            else {
-                return es|e;
-            }
-        }
+                    std::size_t stream_id = std::find(streams.begin(), streams.end(), event.stream) - streams.begin();
+                    if(stream_id == streams.size()) {
+                        streams.push_back(event.stream);
+                    }
 
-        effect_set&& operator|(const effect& e, effect_set&& es) { // FIXME:
-            if(es.type_to_code_[e.type_]) {
-                return std::move(es);
-            }
-            else {
-                return std::move(es |= e);
+                    char buffer[256];
+                    std::snprintf(buffer, sizeof(buffer),
+                                  "%s{\"name\":\"%s\",\"cat\":\"iro\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+                                  "\"args\":{\"stream\":\"%p\",\"call_site\":\"%p\",\"depth\":%u,\"bytes\":%u}}",
+                                  (i == first) ? "" : ",", names[event.type], event.start/1000.0, event.duration/1000.0, static_cast<unsigned>(stream_id),
+                                  static_cast<const void*>(event.stream), event.call_site, static_cast<unsigned>(event.depth), static_cast<unsigned>(event.bytes));
+                    out << buffer;
+                }
+                out << "]}";
             }
-        }
 
+            void clear_trace() {
+                detail::trace_event_count_ = 0;
+            }
+        #endif
 
-        terminal_state_guard::terminal_state_guard(std::ostream& os) : stream_(&os) {
-            location_in_stack_ = detail::push_empty_state_guard(stream_);
+        IRO_TRACE_ENTRY_POINT terminal_state_guard::terminal_state_guard(std::ostream& os) : stream_(&os) {
+            IRO_TRACE_CALL_SITE();
+            detail::push_empty_state_guard(stream_, &entry_);
         }
 
-        terminal_state_guard::terminal_state_guard(std::ostream& os, const effect& e) : stream_(&os) {
-            location_in_stack_ = detail::push_state_guard(stream_, e.type_, e.code_);
+        IRO_TRACE_ENTRY_POINT terminal_state_guard::terminal_state_guard(std::ostream& os, const effect& e) : stream_(&os) {
+            IRO_TRACE_CALL_SITE();
+            detail::push_state_guard(stream_, &entry_, e.type_, e.code_);
         }
 
-        terminal_state_guard::terminal_state_guard(std::ostream& os, const effect_set& e) : stream_(&os) {
-            location_in_stack_ = detail::push_state_guard(stream_, e);
+        IRO_TRACE_ENTRY_POINT terminal_state_guard::terminal_state_guard(std::ostream& os, const effect_set& e) : stream_(&os) {
+            IRO_TRACE_CALL_SITE();
+            detail::push_state_guard(stream_, &entry_, e);
         }
 
         terminal_state_guard::terminal_state_guard(terminal_state_guard&& other) noexcept {
             stream_ = other.stream_;
             other.stream_ = nullptr;
 
-            location_in_stack_ = other.location_in_stack_;
-            other.location_in_stack_ = 0;
+            detail::move_state_guard(&other.entry_, &entry_);
         }
 
         terminal_state_guard& terminal_state_guard::operator=(terminal_state_guard&& rhs) noexcept {
             std::swap(stream_, rhs.stream_);
-            std::swap(location_in_stack_, rhs.location_in_stack_);
+            detail::swap_state_guards(&entry_, &rhs.entry_);
 
             return *this;
         }
 
-        terminal_state_guard::terminal_state_guard(const terminal_state_guard& other) : stream_(other.stream_),
-                                                                                        location_in_stack_(detail::copy_state_guard(other.stream_, other.location_in_stack_)) {}
+        IRO_TRACE_ENTRY_POINT terminal_state_guard::terminal_state_guard(const terminal_state_guard& other) : stream_(other.stream_) {
+            IRO_TRACE_CALL_SITE();
+            if(other.entry_.stack) {
+                detail::copy_state_guard(stream_, &other.entry_, &entry_);
+            }
+        }
 
         terminal_state_guard& terminal_state_guard::operator=(const terminal_state_guard& rhs) {
             return (*this = terminal_state_guard(rhs));
         }
 
-        terminal_state_guard&& terminal_state_guard::operator<<(const effect& e) {
-            detail::set(stream_, location_in_stack_, e.type_, e.code_);
+        IRO_TRACE_ENTRY_POINT terminal_state_guard&& terminal_state_guard::operator<<(const effect& e) {
+            IRO_TRACE_CALL_SITE();
+            detail::set(stream_, &entry_, e.type_, e.code_);
 
             return std::move(*this);
         }
 
-        terminal_state_guard&& terminal_state_guard::operator<<(const effect_set& es) {
-            detail::set(stream_, location_in_stack_, es);
+        IRO_TRACE_ENTRY_POINT terminal_state_guard&& terminal_state_guard::operator<<(const effect_set& es) {
+            IRO_TRACE_CALL_SITE();
+            detail::set(stream_, &entry_, es);
 
             return std::move(*this);
         }
 
-        terminal_state_guard operator<<(std::ostream& stream, const effect& e) {
+        IRO_TRACE_ENTRY_POINT terminal_state_guard operator<<(std::ostream& stream, const effect& e) {
+            IRO_TRACE_CALL_SITE();
             return {stream, e};
         }
 
-        terminal_state_guard operator<<(std::ostream& stream, const effect_set& e) {
+        IRO_TRACE_ENTRY_POINT terminal_state_guard operator<<(std::ostream& stream, const effect_set& e) {
+            IRO_TRACE_CALL_SITE();
             return {stream, e};
         }
 
@@ -610,84 +1134,369 @@ namespace iro {
             return *stream_;
         }
 
-        void terminal_state_guard::delete_early() {
-            if(location_in_stack_ != empty_state_guard_location) {
-                detail::delete_state_guard(stream_, location_in_stack_);
+        IRO_TRACE_ENTRY_POINT void terminal_state_guard::delete_early() {
+            IRO_TRACE_CALL_SITE();
+            if(entry_.stack) {
+                detail::delete_state_guard(stream_, &entry_);
             }
-            location_in_stack_ = empty_state_guard_location;
         }
 
 
-        terminal_state_guard::~terminal_state_guard() {
+        IRO_TRACE_ENTRY_POINT terminal_state_guard::~terminal_state_guard() {
+            IRO_TRACE_CALL_SITE();
             delete_early();
         }
 
-        effect_string::string_and_effects& effect_string::back_() {
-            if(!strings_.size()) {
-                strings_.push_back({});
-            }
-            return strings_.back();
-        }
-
-        const effect_string::string_and_effects& effect_string::back_() const {
-            return strings_.back();
-        }
-
-        effect_string& effect_string::operator<<(const effect_string& arg) {
-            for(auto& string : arg.strings_) {
-                if(back_().active_effects == string.active_effects) {
-                    back_().string += string.string;
+        memory_resource* default_memory_resource() {
+            struct new_delete_resource : memory_resource {
+                void* allocate(std::size_t bytes, std::size_t) override {
+                    return ::operator new(bytes); // new already aligns to max_align_t, which is as much alignment as anything in iro needs
                 }
-                else {
-                    strings_.push_back(std::move(string));
+
+                void deallocate(void* p, std::size_t, std::size_t) override {
+                    ::operator delete(p);
                 }
-            }
+            };
 
-            return *this;
+            static new_delete_resource resource;
+            return &resource;
         }
 
-        effect_string& effect_string::operator<<(effect_string&& arg) {
+        arena::arena(std::size_t block_size) : block_size_(block_size) {}
 
-            for(auto& string : arg.strings_) {
-                if(back_().active_effects == string.active_effects) {
-                    back_().string += std::move(string.string);
-                }
-                else {
-                    strings_.push_back(std::move(string));
-                }
+        void* arena::allocate(std::size_t bytes, std::size_t alignment) {
+            auto align_current = [&]() {
+                auto address = reinterpret_cast<std::uintptr_t>(current_);
+                return current_ + ((alignment - address%alignment) % alignment);
+            };
+
+            char* p = align_current();
+            if(!current_ || (std::size_t(end_-current_) < std::size_t(p-current_) + bytes)) {
+                // the block header takes up the front of the block. Big allocations get a block all to themselves
+                std::size_t size = sizeof(block_t) + std::max(block_size_, bytes + alignment);
+                auto block = static_cast<block_t*>(::operator new(size));
+                block->next = blocks_;
+                blocks_ = block;
+
+                current_ = reinterpret_cast<char*>(block + 1);
+                end_ = reinterpret_cast<char*>(block) + size;
+                p = align_current();
             }
 
-            return *this;
+            current_ = p + bytes;
+            return p;
         }
 
-        effect_string& effect_string::operator+=(const effect_string& arg) {
-            return (*this << arg);
+        void arena::deallocate(void*, std::size_t, std::size_t) {}
+
+        void arena::release() {
+            while(blocks_) {
+                block_t* next = blocks_->next;
+                ::operator delete(blocks_);
+                blocks_ = next;
+            }
+            current_ = end_ = nullptr;
         }
 
-        effect_string& effect_string::operator+=(effect_string&& arg) {
-            return (*this << std::move(arg));
+        arena::~arena() {
+            release();
         }
 
-        std::string effect_string::unsafe_string(const std::ostream& stream) const {
-            std::string ret;
-            for(const auto& string : strings_) {
-                ret += string.string;
+        namespace detail {
+            top_codes_t::top_codes_t(const std::ostream& stream) : state_code(get_top_state_code(&stream)) {
+                for(unsigned i = 0; i < number_of_effect_types; ++i) {
+                    type_to_code[i] = get_top_code(&stream, static_cast<effect_type>(i));
+                }
+            }
 
-                for(unsigned i = 0; i < string.active_effects.size(); ++i) {
-                    if(string.active_effects[i]) {
-                        ret += detail::get_top_code(&stream, static_cast<effect_type>(i));
+            const char* top_codes_t::end_code(const std::array<const char*, number_of_effect_types>& effects) const {
+                const char* ret = nullptr;
+                for(unsigned i = 0; i < number_of_effect_types; ++i) {
+                    if(effects[i]) {
+                        if(ret) { // restoring every effect type at once is one write instead of several
+                            return state_code;
+                        }
+                        ret = type_to_code[i];
                     }
                 }
+
+                return ret;
+            }
+        }
+
+        effect_string::effect_string() : effect_string(*default_memory_resource()) {}
+
+        effect_string::effect_string(memory_resource& resource) : resource_(&resource), strings_(&resource) {}
+
+        effect_string::chunk_t::chunk_t(std::shared_ptr<chunk_t> previous, std::shared_ptr<const strings_t> strings) : previous(std::move(previous)), strings(std::move(strings)) {
+            count = this->previous ? this->previous->count+1 : 1;
+        }
+
+        effect_string::chunk_t::~chunk_t() {
+            // letting each chunk destroy the one before it would recurse once per chunk, which can overflow the stack for a really big string
+            // So the chunks that nothing else refers to are unlinked one at a time here instead
+            while(previous && (previous.use_count() == 1)) {
+                previous = std::move(previous->previous);
             }
+        }
 
+        std::vector<const effect_string::chunk_t*> effect_string::chunks_() const {
+            std::vector<const chunk_t*> ret(last_chunk_ ? last_chunk_->count : 0);
+            auto i = ret.size();
+            for(const chunk_t* chunk = last_chunk_.get(); chunk; chunk = chunk->previous.get()) {
+                ret[--i] = chunk;
+            }
             return ret;
         }
 
+        effect_string::string_and_effects& effect_string::back_() {
+            if(!strings_.size()) {
+                strings_.emplace_back(resource_);
+            }
+            return strings_.back();
+        }
+
+        const effect_string::string_and_effects& effect_string::back_() const {
+            return strings_.back();
+        }
+
+        void effect_string::append_(string_and_effects&& se) {
+            strings_size_ += se.string.size();
+
+            if(strings_.size() && (back_().type_to_code == se.type_to_code)) {
+                back_().string += se.string;
+            }
+            else if(se.string.get_allocator().resource != resource_) { // it came from an effect_string that allocates from somewhere else
+                strings_.emplace_back(resource_);
+                back_().string.assign(se.string.data(), se.string.size());
+                back_().type_to_code = se.type_to_code;
+            }
+            else {
+                strings_.push_back(std::move(se));
+            }
+
+            if(strings_size_ >= detail::effect_string_chunk_size) {
+                seal_();
+            }
+        }
+
+        void effect_string::seal_() {
+            if(strings_.size()) {
+                last_chunk_ = std::allocate_shared<chunk_t>(detail::resource_allocator<chunk_t>(resource_), std::move(last_chunk_),
+                                                            std::allocate_shared<strings_t>(detail::resource_allocator<strings_t>(resource_), std::move(strings_)));
+                strings_.clear();
+                strings_size_ = 0;
+            }
+        }
+
+        void effect_string::append_chunks_(const effect_string& other) {
+            if(!other.last_chunk_) {
+                return;
+            }
+
+            if(!last_chunk_ && !strings_.size()) { // nothing in front of other's chunks, so the whole list can be shared
+                last_chunk_ = other.last_chunk_;
+                return;
+            }
+
+            seal_();
+            for(auto chunk : other.chunks_()) {
+                last_chunk_ = std::allocate_shared<chunk_t>(detail::resource_allocator<chunk_t>(resource_), std::move(last_chunk_), chunk->strings);
+            }
+        }
+
+        effect_string& effect_string::operator<<(const effect_string& arg) {
+            if(&arg == this) {
+                return (*this << effect_string(arg));
+            }
+
+            if(arg.resource_ != resource_) { // chunks can only be shared between effect_strings that allocate from the same place
+                arg.for_each_string_([&](const string_and_effects& string) {
+                    string_and_effects copy(resource_);
+                    copy.string.assign(string.string.data(), string.string.size());
+                    copy.type_to_code = string.type_to_code;
+                    append_(std::move(copy));
+                });
+
+                return *this;
+            }
+
+            append_chunks_(arg);
+            for(auto string : arg.strings_) {
+                append_(std::move(string));
+            }
+
+            return *this;
+        }
+
+        effect_string& effect_string::operator<<(effect_string&& arg) {
+            if(arg.resource_ != resource_) {
+                return (*this << static_cast<const effect_string&>(arg));
+            }
+
+            append_chunks_(arg);
+            for(auto& string : arg.strings_) {
+                append_(std::move(string));
+            }
+
+            return *this;
+        }
+
+        effect_string& effect_string::operator+=(const effect_string& arg) {
+            return (*this << arg);
+        }
+
+        effect_string& effect_string::operator+=(effect_string&& arg) {
+            return (*this << std::move(arg));
+        }
+
+        std::string effect_string::unsafe_string(const std::ostream& stream) const {
+            detail::top_codes_t top_codes(stream);
+
+            std::string ret;
+            for_each_string_([&](const string_and_effects& string) {
+                for(auto code : string.type_to_code) {
+                    if(code) {
+                        ret += code;
+                    }
+                }
+
+                ret.append(string.string.data(), string.string.size());
+
+                if(auto end_code = top_codes.end_code(string.type_to_code)) {
+                    ret += end_code;
+                }
+            });
+
+            return ret;
+        }
+
+        std::size_t effect_string::print_wrapped(std::ostream& stream, unsigned width, overflow::overflow behavior, std::size_t first_line, std::size_t line_count) const {
+            std::size_t line = 0;
+            unsigned column = 0;
+            bool cutting_off = false; // true when we're skipping the rest of a line that's been truncated
+
+            auto is_visible = [&]() {
+                return (line >= first_line) && (line-first_line < line_count);
+            };
+
+            for_each_string_([&](const string_and_effects& string) {
+                bool effects_started = false;
+                const char* run = nullptr; // start of text that's waiting to be written, so that we can write it all at once
+
+                auto start_effects = [&]() {
+                    if(!effects_started) {
+                        for(auto code : string.type_to_code) {
+                            if(code) {
+                                stream << code;
+                            }
+                        }
+                        effects_started = true;
+                    }
+                };
+                auto end_effects = [&]() {
+                    if(effects_started) {
+                        for(unsigned i = 0; i < string.type_to_code.size(); ++i) {
+                            if(string.type_to_code[i]) {
+                                stream << detail::get_top_code(&stream, static_cast<effect_type>(i));
+                            }
+                        }
+                        effects_started = false;
+                    }
+                };
+                auto flush = [&](const char* end) {
+                    if(run) {
+                        start_effects();
+                        stream.write(run, end-run);
+                        run = nullptr;
+                    }
+                };
+
+                const char* c = string.string.data();
+                const char* end = c + string.string.size();
+                while(c < end) {
+                    if(*c == '\n') { // same as a line break from wrapping, so the effects end before the newline instead of running into the edge of the terminal
+                        bool was_visible = is_visible();
+                        flush(c);
+                        if(was_visible) {
+                            end_effects();
+                            stream << '\n';
+                        }
+
+                        ++c;
+                        ++line;
+                        column = 0;
+                        cutting_off = false;
+                        continue;
+                    }
+
+                    unsigned char_width;
+                    const char* next = detail::next_character(c, end, char_width);
+                    if(*c == '\t') {
+                        char_width = detail::tab_width - column%detail::tab_width;
+                    }
+
+                    if(!cutting_off && (column > 0) && (column+char_width > width)) {
+                        if(behavior == overflow::truncate) {
+                            cutting_off = true;
+                        }
+                        else {
+                            bool was_visible = is_visible();
+                            flush(c);
+                            if(was_visible) {
+                                end_effects();
+                                stream << '\n';
+                            }
+
+                            ++line;
+                            column = 0;
+                            if(*c == '\t') {
+                                char_width = detail::tab_width;
+                            }
+                        }
+                    }
+
+                    if(cutting_off) {
+                        flush(c);
+                    }
+                    else {
+                        if(is_visible() && !run) {
+                            run = c;
+                        }
+                        column += char_width;
+                    }
+                    c = next;
+                }
+
+                flush(end);
+                end_effects();
+            });
+
+            return line + (column > 0);
+        }
+
         terminal_state_guard&& operator<<(terminal_state_guard& p, const effect_string& es) {
-            return p << es.unsafe_string(*p.stream_);
+            detail::top_codes_t top_codes(*p.stream_);
+
+            es.for_each_string_([&](const effect_string::string_and_effects& string) { // written piece by piece so that large effect_strings are never flattened into one big std::string
+                for(auto code : string.type_to_code) {
+                    if(code) {
+                        *p.stream_ << code;
+                    }
+                }
+
+                *p.stream_ << string.string;
+
+                if(auto end_code = top_codes.end_code(string.type_to_code)) {
+                    *p.stream_ << end_code;
+                }
+            });
+
+            return std::move(p);
         }
 
-        terminal_state_guard operator<<(std::ostream& os, const effect_string& es) {
+        IRO_TRACE_ENTRY_POINT terminal_state_guard operator<<(std::ostream& os, const effect_string& es) {
+            IRO_TRACE_CALL_SITE();
             terminal_state_guard ret(os);
 
             ret << es;
@@ -695,6 +1504,803 @@ namespace iro {
             return ret;
         }
 
+        namespace detail {
+            // the number of columns a terminal uses to display a code point. This covers the common wide and zero width ranges, not all of unicode
+            unsigned display_width(char32_t code_point) {
+                if((code_point < 0x20) || (code_point == 0x7f) ||
+                   ((code_point >= 0x0300) && (code_point <= 0x036f)) || // combining diacritics
+                   ((code_point >= 0x200b) && (code_point <= 0x200f)) || // zero width spaces and direction marks
+                   ((code_point >= 0xfe00) && (code_point <= 0xfe0f))) { // variation selectors
+                    return 0;
+                }
+                if(((code_point >= 0x1100)  && (code_point <= 0x115f))  || // hangul jamo
+                   ((code_point >= 0x2e80)  && (code_point <= 0xa4cf))  || // CJK
+                   ((code_point >= 0xac00)  && (code_point <= 0xd7a3))  || // hangul syllables
+                   ((code_point >= 0xf900)  && (code_point <= 0xfaff))  ||
+                   ((code_point >= 0xfe30)  && (code_point <= 0xfe4f))  ||
+                   ((code_point >= 0xff00)  && (code_point <= 0xff60))  || // fullwidth forms
+                   ((code_point >= 0xffe0)  && (code_point <= 0xffe6))  ||
+                   ((code_point >= 0x1f300) && (code_point <= 0x1f64f)) || // emoji
+                   ((code_point >= 0x1f900) && (code_point <= 0x1f9ff)) ||
+                   ((code_point >= 0x20000) && (code_point <= 0x3fffd))) {
+                    return 2;
+                }
+                return 1;
+            }
+
+            // a pointer to the character after the escape code at c, or nullptr if c isn't the start of an escape code
+            const char* escape_code_end(const char* c, const char* end) {
+                if((*c != '\x1b') || (c+1 >= end) || (c[1] != '[')) {
+                    return nullptr;
+                }
+
+                c += 2;
+                while((c < end) && !((*c >= 0x40) && (*c <= 0x7e))) {
+                    ++c;
+                }
+                return (c < end) ? c+1 : end;
+            }
+
+            // the number of bytes in the UTF-8 character at c
+            unsigned utf8_length(const char* c, const char* end) {
+                auto byte = static_cast<unsigned char>(*c);
+                unsigned length = (byte < 0x80) ? 1 : ((byte >> 5) == 0x6) ? 2 : ((byte >> 4) == 0xe) ? 3 : ((byte >> 3) == 0x1e) ? 4 : 1; // invalid lead bytes count as one character
+                return (c+length > end) ? 1 : length;
+            }
+
+            // returns a pointer to the character after the one at c (which is a whole escape code if c points to one), and stores its display width in width
+            const char* next_character(const char* c, const char* end, unsigned& width) {
+                if(auto escape_end = escape_code_end(c, end)) { // escape codes that were printed into the string as text don't take up any space
+                    width = 0;
+                    return escape_end;
+                }
+
+                auto byte = static_cast<unsigned char>(*c);
+                unsigned length = utf8_length(c, end);
+
+                char32_t code_point = (length == 1) ? byte : (byte & (0x7f >> length));
+                for(unsigned i = 1; i < length; ++i) {
+                    code_point = (code_point << 6) | (static_cast<unsigned char>(c[i]) & 0x3f);
+                }
+
+                width = display_width(code_point);
+                return c+length;
+            }
+
+            #ifdef IRO_PARALLEL_RENDER
+                // calls f(begin, end) on up to thread_count threads, with [begin, end) covering [0, count) between all of them
+                template<typename F>
+                void parallel_for(std::size_t count, unsigned thread_count, const F& f) {
+                    if(thread_count == 0) {
+                        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+                    }
+                    thread_count = static_cast<unsigned>(std::min<std::size_t>(thread_count, count));
+
+                    if(thread_count <= 1) {
+                        f(std::size_t(0), count);
+                        return;
+                    }
+
+                    std::vector<std::thread> threads;
+                    threads.reserve(thread_count-1);
+                    for(unsigned i = 1; i < thread_count; ++i) {
+                        threads.emplace_back(f, count*i/thread_count, count*(i+1)/thread_count);
+                    }
+                    f(std::size_t(0), count/thread_count); // the calling thread takes the first block instead of sitting idle
+
+                    for(auto& thread : threads) {
+                        thread.join();
+                    }
+                }
+            #endif
+        }
+
+        #ifdef IRO_PARALLEL_RENDER
+            // top_codes_ is the only part that touches the stack, so it has to be filled in here and not on the worker threads
+            parallel_render::parallel_render(const std::ostream& stream, const effect_string* first, const effect_string* last, unsigned thread_count) : top_codes_(stream),
+                                                                                                                                                       first_(first),
+                                                                                                                                                       thread_count_(thread_count) {
+                std::size_t count = last-first;
+                offsets_.resize(count+1);
+                detail::parallel_for(count, thread_count_, [&](std::size_t begin, std::size_t end) {
+                    for(std::size_t i = begin; i < end; ++i) {
+                        offsets_[i+1] = rendered_size_(first_[i]);
+                    }
+                });
+
+                offsets_[0] = 0;
+                for(std::size_t i = 0; i < count; ++i) { // prefix sum turns sizes into offsets
+                    offsets_[i+1] += offsets_[i];
+                }
+            }
+        #endif
+
+        cached_effect_string::cached_effect_string(effect_string es) : string_(std::move(es)) {}
+
+        const effect_string& cached_effect_string::string() const {
+            return string_;
+        }
+
+        const std::string& cached_effect_string::unsafe_string(const std::ostream& stream) const {
+            auto generation = detail::state_generation(&stream);
+            if((&stream != rendered_stream_) || (generation != rendered_generation_)) {
+                rendered_ = string_.unsafe_string(stream);
+                rendered_stream_ = &stream;
+                rendered_generation_ = generation;
+            }
+
+            return rendered_;
+        }
+
+        terminal_state_guard&& operator<<(terminal_state_guard& p, const cached_effect_string& ces) {
+            return p << ces.unsafe_string(*p.stream_);
+        }
+
+        std::ostream& operator<<(std::ostream& os, const cached_effect_string& ces) {
+            return os << ces.unsafe_string(os);
+        }
+
+        namespace detail {
+            // which of line_relay's child codes an SGR parameter turns on or off. Returns -1 for parameters that aren't kept track of
+            int relay_code_index(unsigned parameter, bool& turns_off) {
+                turns_off = false;
+                switch(parameter) {
+                    case 39:  turns_off = true; // fallthrough
+                    case 30: case 31: case 32: case 33: case 34: case 35: case 36: case 37: case 38:
+                    case 90: case 91: case 92: case 93: case 94: case 95: case 96: case 97:
+                        return foreground_color;
+                    case 49:  turns_off = true; // fallthrough
+                    case 40:  case 41:  case 42:  case 43:  case 44:  case 45:  case 46:  case 47:  case 48:
+                    case 100: case 101: case 102: case 103: case 104: case 105: case 106: case 107:
+                        return background_color;
+                    case 22: turns_off = true; // fallthrough
+                    case 1: case 2:
+                        return font_weight;
+                    case 24: turns_off = true; // fallthrough
+                    case 4: case 21:
+                        return underlinedness;
+                    case 25: turns_off = true; // fallthrough
+                    case 5: case 6:
+                        return blink;
+                    case 23: case 27: case 28: case 29:
+                        turns_off = true;
+                        return number_of_effect_types + (parameter-23 ? parameter-26 : 0); // 23 -> italic, 27 -> inverse, 28 -> hidden, 29 -> crossed out
+                    case 3: case 7: case 8: case 9:
+                        return number_of_effect_types + (parameter-3 ? parameter-6 : 0);  //  3 -> italic,  7 -> inverse,  8 -> hidden,  9 -> crossed out
+                    default:
+                        return -1;
+                }
+            }
+        }
+
+        line_relay::line_relay(std::ostream& stream, effect_string prefix, std::size_t buffer_size) : stream_(stream), prefix_(std::move(prefix)),
+                                                                                                     buffer_(new char[buffer_size]), capacity_(buffer_size) {
+            assert(buffer_size > 0);
+        }
+
+        const char* line_relay::rewrite_escape_code_(const char* c, const char* end) {
+            if(end-c < 2) { // a lone escape at the end of the line (or the file) would swallow whatever the stream prints next, so it gets dropped
+                return end;
+            }
+            if(c[1] != '[') { // not a control sequence, so it can't change any effects
+                out_ += *c;
+                return c+1;
+            }
+
+            const char* parameters = c+2;
+            const char* final = std::find_if(parameters, end, [](char ch) { return (ch >= 0x40) && (ch <= 0x7e); });
+            if(final == end) { // cut off by the end of the line or the file. Passing it on would make the terminal read the next thing we print as the rest of it, so it gets dropped too
+                return end;
+            }
+
+            bool is_sgr = (*final == 'm') && std::all_of(parameters, final, [](char ch) { return ((ch >= '0') && (ch <= '9')) || (ch == ';') || (ch == ':'); });
+            if(!is_sgr) { // cursor movement, clearing the screen, etc. just get passed through
+                out_.append(c, final+1);
+                return final+1;
+            }
+
+            bool code_open = false; // whether out_ ends in a code that still needs its m
+            auto pass = [&](const char* begin, const char* end) {
+                out_ += code_open ? ";" : "\x1b[";
+                out_.append(begin, end);
+                code_open = true;
+            };
+            auto substitute = [&](const char* code) {
+                if(code_open) {
+                    out_ += 'm';
+                    code_open = false;
+                }
+                out_ += code;
+            };
+
+            const char* value_end;
+            for(const char* parameter = parameters; ; parameter = value_end+1) {
+                const char* parameter_end = std::find(parameter, final, ';');
+                value_end = parameter_end;
+
+                unsigned n = 0;
+                const char* digits_end = parameter;
+                for(; (digits_end != parameter_end) && (*digits_end >= '0') && (*digits_end <= '9'); ++digits_end) {
+                    n = std::min(n*10 + (*digits_end-'0'), 1000u);
+                }
+
+                // 38;5;n and 38;2;r;g;b (and the same for 48 and 58) are one color spread over several parameters. The colon form (38:5:n) is already one parameter
+                if(((n == 38) || (n == 48) || (n == 58)) && (digits_end == parameter_end) && (parameter_end != final)) {
+                    const char* argument = parameter_end+1;
+                    const char* argument_end = std::find(argument, final, ';');
+                    unsigned count = ((argument_end-argument == 1) && (*argument == '5')) ? 1 :
+                                     ((argument_end-argument == 1) && (*argument == '2')) ? 3 : 0;
+                    value_end = argument_end;
+                    for(; count && (value_end != final); --count) {
+                        value_end = std::find(value_end+1, final, ';');
+                    }
+                }
+
+                bool turns_off;
+                int index = detail::relay_code_index(n, turns_off);
+
+                if((n == 0) && (digits_end == parameter_end)) { // a reset (an empty parameter counts too) goes back to the stream's effects, not the terminal's defaults
+                    substitute("\x1b[0m");
+                    substitute(detail::get_top_state_code(&stream_));
+                    for(auto& code : child_codes_) {
+                        code.clear();
+                    }
+                }
+                else if(index < 0) {
+                    pass(parameter, value_end);
+                }
+                else if(!turns_off) {
+                    child_codes_[index].assign(parameter, value_end);
+                    pass(parameter, value_end);
+                }
+                else {
+                    child_codes_[index].clear();
+                    if(index < number_of_effect_types) {
+                        substitute(detail::get_top_code(&stream_, static_cast<effect_type>(index)));
+                    }
+                    else {
+                        pass(parameter, value_end);
+                    }
+                }
+
+                if(value_end == final) {
+                    break;
+                }
+            }
+
+            if(code_open) {
+                out_ += 'm';
+            }
+
+            return final+1;
+        }
+
+        void line_relay::start_child_codes_() {
+            bool any = false;
+            for(const auto& code : child_codes_) {
+                if(code.size()) {
+                    out_ += any ? ";" : "\x1b[";
+                    out_ += code;
+                    any = true;
+                }
+            }
+            if(any) {
+                out_ += 'm';
+            }
+        }
+
+        void line_relay::end_child_codes_() {
+            static constexpr std::array<const char*, 4> other_off_codes = {"\x1b[23m", "\x1b[27m", "\x1b[28m", "\x1b[29m"};
+
+            for(unsigned i = 0; i < child_codes_.size(); ++i) {
+                if(child_codes_[i].size()) {
+                    out_ += (i < number_of_effect_types) ? detail::get_top_code(&stream_, static_cast<effect_type>(i)) : other_off_codes[i-number_of_effect_types];
+                }
+            }
+        }
+
+        void line_relay::write_(const char* c, const char* end) {
+            out_.clear();
+            const std::string& prefix = prefix_.unsafe_string(stream_); // nothing can change the stream's effects while this runs, so this only needs to be looked up once
+
+            while(c != end) {
+                if(at_line_start_) {
+                    out_ += prefix;
+                    start_child_codes_();
+                    at_line_start_ = false;
+                }
+
+                auto line_end = static_cast<const char*>(std::memchr(c, '\n', end-c));
+                if(!line_end) {
+                    line_end = end;
+                }
+
+                while(c != line_end) { // the text between escape codes is copied in one go
+                    auto escape = static_cast<const char*>(std::memchr(c, '\x1b', line_end-c));
+                    if(!escape) {
+                        escape = line_end;
+                    }
+                    out_.append(c, escape);
+
+                    c = (escape == line_end) ? line_end : rewrite_escape_code_(escape, line_end);
+                }
+
+                if(line_end != end) {
+                    end_child_codes_();
+                    out_ += '\n';
+                    at_line_start_ = true;
+                    ++c;
+                }
+            }
+
+            stream_.write(out_.data(), out_.size());
+            stream_.flush();
+        }
+
+        std::size_t line_relay::relay(int fd) {
+            #ifdef IRO_WINDOWS
+                int n = _read(fd, buffer_.get()+size_, static_cast<unsigned>(capacity_-size_));
+            #else
+                ssize_t n;
+                do {
+                    n = read(fd, buffer_.get()+size_, capacity_-size_);
+                } while((n < 0) && (errno == EINTR));
+            #endif
+
+            if(n < 0) {
+                throw std::system_error(errno, std::generic_category(), "iro::line_relay::relay");
+            }
+
+            const char* begin = buffer_.get();
+            const char* end = begin + size_ + n;
+
+            if(n == 0) { // end of file, so the unfinished line is as finished as it's going to get
+                write_(begin, end);
+                if(!at_line_start_) {
+                    out_.clear();
+                    end_child_codes_();
+                    stream_.write(out_.data(), out_.size());
+                    stream_.flush();
+                    at_line_start_ = true;
+                }
+                for(auto& code : child_codes_) { // whatever the child had turned on ended with it
+                    code.clear();
+                }
+                size_ = 0;
+                return 0;
+            }
+
+            const char* write_end = end; // only the new data can have a newline in it
+            while((write_end != begin+size_) && (write_end[-1] != '\n')) {
+                --write_end;
+            }
+
+            if(write_end == begin+size_) {
+                if(end != begin+capacity_) {
+                    size_ += n;
+                    return n;
+                }
+
+                // this line doesn't fit in the buffer, so write as much of it as we can. The only thing that has to wait is an escape code that's been cut off
+                write_end = end;
+                for(const char* c = end; (c != begin) && (end-c < 32); --c) {
+                    if(c[-1] == '\x1b') {
+                        if((c == end) || ((*c == '[') && std::none_of(c+1, end, [](char ch) { return (ch >= 0x40) && (ch <= 0x7e); }))) {
+                            write_end = (c-1 == begin) ? end : c-1;
+                        }
+                        break;
+                    }
+                }
+            }
+
+            write_(begin, write_end);
+
+            size_ = end-write_end;
+            std::memmove(buffer_.get(), write_end, size_);
+
+            return n;
+        }
+
+        namespace detail {
+            void append_number(std::string& out, unsigned n) { // n is at most 255, and this is a lot faster than going through a stream
+                if(n >= 100) {
+                    out += static_cast<char>('0' + n/100);
+                }
+                if(n >= 10) {
+                    out += static_cast<char>('0' + (n/10)%10);
+                }
+                out += static_cast<char>('0' + n%10);
+            }
+
+            void append_color_code(std::string& out, color::color c, effect_type type) {
+                unsigned code = (type == foreground_color) ? 30 : 40;
+                code += (c < color::bright_black) ? c : (60 + c - color::bright_black);
+
+                out += "\x1b[";
+                append_number(out, code);
+                out += 'm';
+            }
+
+            void append_color_code(std::string& out, std::uint8_t c, effect_type type) {
+                out += (type == foreground_color) ? "\x1b[38;5;" : "\x1b[48;5;";
+                append_number(out, c);
+                out += 'm';
+            }
+
+            void append_color_code(std::string& out, const rgb& c, effect_type type) {
+                out += (type == foreground_color) ? "\x1b[38;2;" : "\x1b[48;2;";
+                append_number(out, c.r);
+                out += ';';
+                append_number(out, c.g);
+                out += ';';
+                append_number(out, c.b);
+                out += 'm';
+            }
+
+            template<typename T>
+            void print_colored(std::ostream& stream, const std::string& text, const T* colors, std::size_t color_count, effect_type type) {
+                assert((type == foreground_color) || (type == background_color));
+
+                std::string out;
+                out.reserve(text.size()*4); // enough for a short code every couple of characters without reallocating
+
+                const char* c = text.data();
+                const char* end = c + text.size();
+                const char* run = c;           // start of text that hasn't been copied to out yet
+                const T* previous = nullptr;
+
+                std::size_t i = 0;
+                while(c < end) {
+                    if(auto escape_end = escape_code_end(c, end)) {
+                        c = escape_end;
+                        continue;
+                    }
+
+                    assert(i < color_count);
+                    if((i < color_count) && (!previous || (colors[i] != *previous))) {
+                        out.append(run, c);
+                        run = c;
+
+                        append_color_code(out, colors[i], type);
+                        previous = &colors[i];
+                    }
+
+                    c += utf8_length(c, end);
+                    ++i;
+                }
+                out.append(run, end);
+                assert(i == color_count);
+
+                if(previous) {
+                    out += get_top_code(&stream, type);
+                }
+
+                stream.write(out.data(), out.size());
+            }
+        }
+
+        void print_colored(std::ostream& stream, const std::string& text, const color::color* colors, std::size_t color_count, effect_type type) {
+            detail::print_colored(stream, text, colors, color_count, type);
+        }
+
+        void print_colored(std::ostream& stream, const std::string& text, const std::uint8_t* colors, std::size_t color_count, effect_type type) {
+            detail::print_colored(stream, text, colors, color_count, type);
+        }
+
+        void print_colored(std::ostream& stream, const std::string& text, const rgb* colors, std::size_t color_count, effect_type type) {
+            detail::print_colored(stream, text, colors, color_count, type);
+        }
+
+        namespace detail {
+            // journals are made of records that start with one of these, followed by varints and strings (which are a varint length followed by the characters)
+            //   set record:  the set's id, then a string for each effect type (empty if the set has no effect of that type)
+            //   text record: the number of bytes in the rest of the record, then pairs of a set id and a string
+            constexpr char journal_magic[] = {'i', 'r', 'o', 'j', 1}; // last byte is the version
+            constexpr char journal_set_record  = 's';
+            constexpr char journal_text_record = 't';
+
+            void write_varint(std::ostream& out, std::uint64_t n) {
+                while(n >= 0x80) {
+                    out.put(static_cast<char>((n & 0x7f) | 0x80));
+                    n >>= 7;
+                }
+                out.put(static_cast<char>(n));
+            }
+
+            bool read_varint(std::istream& in, std::uint64_t& n) {
+                n = 0;
+                for(unsigned shift = 0; shift < 64; shift += 7) {
+                    auto c = in.get();
+                    if(c == std::istream::traits_type::eof()) {
+                        return false;
+                    }
+                    n |= std::uint64_t(c & 0x7f) << shift;
+                    if(!(c & 0x80)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // same as above, but reads from memory. Returns a pointer to the byte after the varint, or nullptr if it runs past end
+            const char* read_varint(const char* c, const char* end, std::uint64_t& n) {
+                n = 0;
+                for(unsigned shift = 0; (shift < 64) && (c < end); shift += 7) {
+                    auto byte = static_cast<unsigned char>(*c++);
+                    n |= std::uint64_t(byte & 0x7f) << shift;
+                    if(!(byte & 0x80)) {
+                        return c;
+                    }
+                }
+                return nullptr;
+            }
+
+            std::size_t varint_size(std::uint64_t n) {
+                std::size_t ret = 1;
+                while(n >= 0x80) {
+                    n >>= 7;
+                    ++ret;
+                }
+                return ret;
+            }
+        }
+
+        journal_writer::journal_writer(std::ostream& out) : out_(out) {
+            out_.write(detail::journal_magic, sizeof(detail::journal_magic));
+        }
+
+        std::uint64_t journal_writer::set_id_(const std::array<const char*, number_of_effect_types>& type_to_code) {
+            if(type_to_code == detail::filled_array<number_of_effect_types>(static_cast<const char*>(nullptr))) {
+                return 0;
+            }
+
+            for(std::size_t i = sets_.size(); i > 0; --i) { // there are usually only a handful of sets, and the recent ones are the likeliest to be reused
+                if(sets_[i-1] == type_to_code) {
+                    return i;
+                }
+            }
+
+            sets_.push_back(type_to_code);
+
+            out_.put(detail::journal_set_record);
+            detail::write_varint(out_, sets_.size());
+            for(auto code : type_to_code) {
+                auto length = code ? std::strlen(code) : 0;
+                detail::write_varint(out_, length);
+                out_.write(code, length);
+            }
+
+            return sets_.size();
+        }
+
+        void journal_writer::append(const effect_string& es) {
+            std::vector<std::uint64_t> ids; // set records have to be written before the text record that uses them, so this has to happen first
+            std::uint64_t size = 0;
+            es.for_each_string_([&](const effect_string::string_and_effects& string) {
+                ids.push_back(set_id_(string.type_to_code));
+                size += detail::varint_size(ids.back()) + detail::varint_size(string.string.size()) + string.string.size();
+            });
+
+            out_.put(detail::journal_text_record);
+            detail::write_varint(out_, size);
+
+            std::size_t i = 0;
+            es.for_each_string_([&](const effect_string::string_and_effects& string) {
+                detail::write_varint(out_, ids[i++]);
+                detail::write_varint(out_, string.string.size());
+                out_.write(string.string.data(), string.string.size());
+            });
+        }
+
+        journal_reader::journal_reader(std::istream& in) : in_(in) {
+            char magic[sizeof(detail::journal_magic)];
+            if(!in_.read(magic, sizeof(magic)) || !std::equal(magic, magic+sizeof(magic), detail::journal_magic)) {
+                throw std::runtime_error("iro::journal_reader: not an iro journal (or an unsupported version)");
+            }
+
+            end_ = in_.tellg();
+            refresh();
+        }
+
+        std::size_t journal_reader::refresh() {
+            // seeking throws away the stream's buffer, so the end of the stream is only looked up once,
+            // and the position is kept track of by hand instead of with tellg
+            in_.clear();
+            in_.seekg(0, std::ios::end);
+            auto stream_end = in_.tellg();
+            in_.seekg(end_);
+
+            auto position = end_;
+            for(;;) {
+                auto start = position;
+
+                auto tag = in_.get();
+                if(tag == std::istream::traits_type::eof()) {
+                    break;
+                }
+
+                if(tag == detail::journal_magic[0]) { // another journal_writer was opened on the end of the journal, which starts a new session
+                    char magic[sizeof(detail::journal_magic)] = {detail::journal_magic[0]};
+                    if(!in_.read(magic+1, sizeof(magic)-1)) { // the writer is probably in the middle of writing this, so try again next time
+                        break;
+                    }
+                    if(!std::equal(magic, magic+sizeof(magic), detail::journal_magic)) {
+                        throw std::runtime_error("iro::journal_reader: corrupt journal");
+                    }
+
+                    session_first_set_ = sets_.size();
+                    position += sizeof(magic);
+                    end_ = position;
+                    continue;
+                }
+
+                std::uint64_t n;
+                if(!detail::read_varint(in_, n)) {
+                    break;
+                }
+                position += 1 + detail::varint_size(n);
+
+                if(tag == detail::journal_set_record) {
+                    if(n != sets_.size()-session_first_set_+1) {
+                        throw std::runtime_error("iro::journal_reader: corrupt journal");
+                    }
+
+                    std::array<std::string, number_of_effect_types> codes;
+                    bool complete = true;
+                    for(auto& code : codes) {
+                        std::uint64_t length;
+                        complete = complete && detail::read_varint(in_, length);
+                        if(complete) {
+                            code.resize(length);
+                            complete = length ? static_cast<bool>(in_.read(&code[0], length)) : true;
+                            position += detail::varint_size(length) + length;
+                        }
+                    }
+                    if(!complete) { // same as above
+                        break;
+                    }
+
+                    set_codes_.push_back(std::move(codes));
+                    std::array<const char*, number_of_effect_types> type_to_code;
+                    for(unsigned i = 0; i < number_of_effect_types; ++i) {
+                        type_to_code[i] = set_codes_.back()[i].empty() ? nullptr : set_codes_.back()[i].c_str();
+                    }
+                    sets_.push_back(type_to_code);
+                }
+                else if(tag == detail::journal_text_record) {
+                    if(stream_end-position < static_cast<std::streamoff>(n)) { // incomplete record, same as above
+                        break;
+                    }
+                    in_.ignore(static_cast<std::streamsize>(n)); // reads through the buffer instead of seeking
+
+                    records_.push_back({position, n, session_first_set_, sets_.size()});
+                    position += static_cast<std::streamoff>(n);
+                }
+                else {
+                    throw std::runtime_error("iro::journal_reader: corrupt journal");
+                }
+
+                end_ = position;
+            }
+
+            in_.clear();
+            return size();
+        }
+
+        std::size_t journal_reader::size() const {
+            return records_.size();
+        }
+
+        template<typename F>
+        void journal_reader::read_record_(std::size_t index, F&& f) const {
+            const auto& record = records_.at(index);
+
+            std::string data(record.size, '\0'); // one read for the whole record, then it gets split up in memory
+            in_.clear();
+            in_.seekg(record.position);
+            if(record.size && !in_.read(&data[0], record.size)) {
+                throw std::runtime_error("iro::journal_reader: journal was truncated");
+            }
+
+            static const std::array<const char*, number_of_effect_types> no_effects = detail::filled_array<number_of_effect_types>(static_cast<const char*>(nullptr));
+
+            const char* c = data.data();
+            const char* end = c + data.size();
+            while(c < end) {
+                std::uint64_t id, length;
+                c = detail::read_varint(c, end, id);
+                c = c ? detail::read_varint(c, end, length) : nullptr;
+                if(!c || (id > record.sets_end-record.first_set) || (length > std::uint64_t(end-c))) {
+                    throw std::runtime_error("iro::journal_reader: corrupt journal");
+                }
+
+                f(id ? sets_[record.first_set+id-1] : no_effects, std::string(c, length));
+                c += length;
+            }
+        }
+
+        effect_string journal_reader::record(std::size_t index) const {
+            effect_string ret;
+            read_record_(index, [&](const std::array<const char*, number_of_effect_types>& type_to_code, std::string&& text) {
+                effect_string::string_and_effects se(ret.resource_);
+                se.type_to_code = type_to_code;
+                se.string.assign(text.data(), text.size());
+
+                ret.append_(std::move(se));
+            });
+
+            return ret;
+        }
+
+        std::string journal_reader::plain_text(std::size_t index) const {
+            std::string ret;
+            read_record_(index, [&](const std::array<const char*, number_of_effect_types>&, std::string&& text) {
+                ret += text;
+            });
+
+            return ret;
+        }
+
+        #ifdef IRO_PARALLEL_RENDER
+            std::size_t parallel_render::rendered_size_(const effect_string& es) const {
+                std::size_t ret = 0;
+                es.for_each_string_([&](const effect_string::string_and_effects& string) {
+                    ret += string.string.size();
+
+                    for(auto code : string.type_to_code) {
+                        if(code) {
+                            ret += std::strlen(code);
+                        }
+                    }
+                    if(auto end_code = top_codes_.end_code(string.type_to_code)) {
+                        ret += std::strlen(end_code);
+                    }
+                });
+
+                return ret;
+            }
+
+            void parallel_render::render_(const effect_string& es, char* out) const {
+                es.for_each_string_([&](const effect_string::string_and_effects& string) {
+                    for(auto code : string.type_to_code) {
+                        if(code) {
+                            auto length = std::strlen(code);
+                            std::memcpy(out, code, length);
+                            out += length;
+                        }
+                    }
+
+                    std::memcpy(out, string.string.data(), string.string.size());
+                    out += string.string.size();
+
+                    if(auto end_code = top_codes_.end_code(string.type_to_code)) {
+                        auto length = std::strlen(end_code);
+                        std::memcpy(out, end_code, length);
+                        out += length;
+                    }
+                });
+            }
+
+            std::size_t parallel_render::size() const {
+                return offsets_.back();
+            }
+
+            void parallel_render::write(char* buffer) const {
+                detail::parallel_for(offsets_.size()-1, thread_count_, [&](std::size_t begin, std::size_t end) {
+                    for(std::size_t i = begin; i < end; ++i) {
+                        render_(first_[i], buffer+offsets_[i]);
+                    }
+                });
+            }
+
+            std::string parallel_render::str() const {
+                std::string ret(size(), '\0');
+                write(&ret[0]);
+
+                return ret;
+            }
+        #endif
+
         namespace detail {
             #ifdef IRO_UNIX
                 bool stdout_isatty() {
@@ -712,6 +2318,12 @@ namespace iro {
                 }
             #endif
 
+            // cout and cerr share a stack when they're both attached to the terminal. This gets checked on every stack lookup and every code that's written, so it's only worked out once
+            bool stdout_and_stderr_share_terminal() {
+                static const bool ret = stdout_isatty() && stderr_isatty();
+                return ret;
+            }
+
             bool isatty(const std::ostream& os) {
                 if(&os == &std::cout) {
                     return stdout_isatty();
@@ -724,13 +2336,9 @@ namespace iro {
                 }
             }
 
-            effect create(const char* code, effect_type type) noexcept {
-                return {code, type};
-            }
-
             struct effect_type_to_stream_hash_t {
                 std::size_t operator()(const std::ostream* os) const {
-                    if(((os == &std::cout) || (os == &std::cerr)) && stdout_isatty() && stderr_isatty()) {
+                    if(((os == &std::cout) || (os == &std::cerr)) && stdout_and_stderr_share_terminal()) {
                         return std::hash<const std::ostream*>()(&std::cout);
                     }
                     else {
@@ -741,7 +2349,7 @@ namespace iro {
 
             struct effect_type_to_stream_equals_t {
                 std::size_t operator()(const std::ostream* lhs, const std::ostream* rhs) const {
-                    if(((lhs == &std::cout) || (lhs == &std::cerr)) && ((rhs == &std::cout) || (rhs == &std::cerr)) && stdout_isatty() && stderr_isatty()) {
+                    if(((lhs == &std::cout) || (lhs == &std::cerr)) && ((rhs == &std::cout) || (rhs == &std::cerr)) && stdout_and_stderr_share_terminal()) {
                         return true;
                     }
                     else {
@@ -750,159 +2358,286 @@ namespace iro {
                 }
             };
 
-            struct effect_entry_t {
-                std::array<const char*, number_of_effect_types> type_to_code;
-                bool is_empty = false; // I'm not a huge fan of there being two distinct empty states, but I can't think of another way to implement the behavior I want
-                bool is_destructed = false;
+            static constexpr std::array<const char*, number_of_effect_types> effect_type_to_default_code_ = {"\x1b[39m",
+                                                                                                   "\x1b[49m",
+                                                                                                   "\x1b[22m",
+                                                                                                   "\x1b[24m",
+                                                                                                   "\x1b[25m"};
 
-                static effect_entry_t create_empty() {
-                    return {filled_array<const char*>(nullptr), true};
+            void update_state_code(effect_entry_t* entry) {
+                char* out = entry->state_code;
+                *out++ = '\x1b';
+                *out++ = '[';
+                for(unsigned i = 0; i < number_of_effect_types; ++i) {
+                    if(i) {
+                        *out++ = ';';
+                    }
+                    for(const char* c = entry->state[i]+2; *c != 'm'; ++c) { // every code looks like \x1b[<parameters>m, so combining them is just a matter of joining the parameters
+                        *out++ = *c;
+                    }
                 }
-            };
+                *out++ = 'm';
+                *out = '\0';
+            }
 
-            // TODO: write a struct that contains the stack and an array of uints that point to the top non-empty location for each effect type.
-            //  That way you don't have to iterate down from the top of the stack every time you want to find the top non-empty location.
-            //  Simple space-time tradeoff
+            void inherit_state(effect_entry_t* entry, const effect_entry_t* below) {
+                for(unsigned i = 0; i < number_of_effect_types; ++i) {
+                    entry->state[i] = entry->type_to_code[i] ? entry->type_to_code[i] : below->state[i];
+                }
+                update_state_code(entry);
+            }
 
-            struct stack_and_top_nonempty_location {
-                std::vector<effect_entry_t> stack;
-                std::array<unsigned, number_of_effect_types> top_nonempty_location;
+            // the entries themselves are owned by the state guards, so all a stream needs to own is the bottom entry (which holds the default codes) and a pointer to the top
+            struct stream_stack_t {
+                effect_entry_t base;
+                effect_entry_t* top = &base;
+                effect_entry_t* pending = nullptr; // the most recently pushed state guard, if it hasn't been linked on top of the stack yet. See push_empty_state_guard
+                std::uint64_t generation = 0;      // incremented every time the top codes might have changed
+                std::size_t depth = 0;             // number of state guards in the stack, not counting base
+
+                stream_stack_t() {
+                    base.type_to_code = effect_type_to_default_code_;
+                    base.state = effect_type_to_default_code_;
+                    base.stack = this;
+                    update_state_code(&base);
+                }
+
+                stream_stack_t(const stream_stack_t&) = delete; // entries point back at their stack, so it must never move
+                stream_stack_t& operator=(const stream_stack_t&) = delete;
             };
 
-            static std::unordered_map<const std::ostream*,
-                                      std::vector<effect_entry_t>,
-                                      effect_type_to_stream_hash_t, effect_type_to_stream_equals_t> stream_to_stack_;
+            static std::ostream* streams_[] = {&std::cout, &std::cerr};
 
-            static std::array<const char*, number_of_effect_types> effect_type_to_default_code_ = {"\x1b[39m",
-                                                                                                   "\x1b[49m",
-                                                                                                   "\x1b[22m",
-                                                                                                   "\x1b[24m",
-                                                                                                   "\x1b[25m"};
+            void write_code(std::ostream* stream, const char* code) {
+                #ifdef IRO_TRACE
+                    trace_bytes_ += std::strlen(code);
+                #endif
+
+                *stream << code;
+                if(stdout_and_stderr_share_terminal()) {
+                    for(unsigned i = 0; i < 2; ++i) {
+                        if(stream == streams_[i]) {
+                            *streams_[!i] << code;
+                            break;
+                        }          // ^ !i turns 0 into 1 and 1 into 0,
+                                   // so this basically says "if the stream is cout, also print this effect to cerr,
+                                   // and if the stream is cerr, also print this effect to cout
+                    }
+                }
+            }
 
-            static std::ostream* streams_[] = {&std::cout, &std::cerr};
+            effect_entry_t* logical_top(stream_stack_t& stack) {
+                return stack.pending ? stack.pending : stack.top;
+            }
 
-            // returns location in map
-            unsigned push_state_guard(std::ostream* stream, effect_type type, const char* code) {
-                auto ret = push_empty_state_guard(stream);
-                set_top(stream, type, code);
+            // the pending entry is logically above the top of the stack, even though it isn't linked to it
+            effect_entry_t* logically_above(const effect_entry_t* entry) {
+                if(entry->above) {
+                    return entry->above;
+                }
+                auto pending = entry->stack->pending;
+                return (pending != entry) ? pending : nullptr;
+            }
 
-                return ret;
+            void link_pending(stream_stack_t& stack) {
+                if(stack.pending) {
+                    stack.pending->below = stack.top;
+                    stack.top->above = stack.pending;
+                    stack.top = stack.pending;
+                    stack.pending = nullptr;
+                }
             }
 
-            unsigned push_empty_state_guard(std::ostream* stream) {
-                if(!stream_to_stack_.count(stream)) { // I'm using c++14, so .contains() isn't available :(
-                    stream_to_stack_[stream].push_back({effect_type_to_default_code_});
+            stream_stack_t& get_stack(const std::ostream* stream) {
+                static std::unordered_map<const std::ostream*,
+                                          stream_stack_t,
+                                          effect_type_to_stream_hash_t, effect_type_to_stream_equals_t> stream_to_stack_; // function local so that it exists even if a state guard is created during static initialization
+
+                return stream_to_stack_[stream]; // constructs the stack in place the first time a stream is seen
+            }
+
+            #ifdef IRO_TRACE
+                std::size_t stack_depth(const std::ostream* stream) {
+                    return get_stack(stream).depth;
                 }
-                auto& stack = stream_to_stack_.at(stream);
-                unsigned ret = stack.size();
-                stack.push_back(effect_entry_t::create_empty());
+            #endif
 
-                return ret;
+            void push_state_guard(std::ostream* stream, effect_entry_t* entry, effect_type type, const char* code) {
+                IRO_TRACE_SCOPE(trace_push, stream);
+                push_empty_state_guard(stream, entry);
+                set(stream, entry, type, code);
+            }
+
+            // A newly pushed state guard starts out pending: it's logically on top of the stack, but it isn't linked in until another state guard gets pushed on top of it.
+            // Most state guards are temporaries like the one in std::cout << iro::red << "text", which never have anything pushed on top of them,
+            // so when they're deleted, they only have to reset the effect types they set
+            void push_empty_state_guard(std::ostream* stream, effect_entry_t* entry) {
+                IRO_TRACE_SCOPE(trace_push, stream);
+
+                auto& stack = get_stack(stream);
+                link_pending(stack);
+                ++stack.depth;
+
+                *entry = effect_entry_t::create_empty();
+                entry->stack = &stack;
+                entry->state = stack.top->state;
+                std::memcpy(entry->state_code, stack.top->state_code, sizeof(entry->state_code));
+                stack.pending = entry;
             }
 
-            unsigned push_state_guard(std::ostream* stream, const effect_set& effects) {
-                auto ret = push_empty_state_guard(stream);
+            void push_state_guard(std::ostream* stream, effect_entry_t* entry, const effect_set& effects) {
+                IRO_TRACE_SCOPE(trace_push, stream);
+                push_empty_state_guard(stream, entry);
                 for(unsigned i = 0; i < number_of_effect_types; ++i) {
                     if(effects.type_to_code_[i]) {
-                        set_top(stream, static_cast<effect_type>(i), effects.type_to_code_[i]);
+                        set(stream, entry, static_cast<effect_type>(i), effects.type_to_code_[i]);
                     }
                 }
-
-                return ret;
             }
 
-            unsigned copy_state_guard(std::ostream* stream, unsigned index_in_stack) {
-                auto& stack = stream_to_stack_.at(stream);
-                return push_state_guard(stream, {stack[index_in_stack].type_to_code}); // push calls set, which takes care of setting is_empty, so we don't have to copy it from the old state guard's entry manually
+            void copy_state_guard(std::ostream* stream, const effect_entry_t* source, effect_entry_t* entry) {
+                IRO_TRACE_SCOPE(trace_copy, stream);
+                push_state_guard(stream, entry, {source->type_to_code}); // push calls set, which takes care of setting is_empty, so we don't have to copy it from the old state guard's entry manually
             }
 
-            void delete_state_guard(std::ostream* stream, unsigned index_in_stack) {
-                auto& stack = stream_to_stack_.at(stream);
+            // moves the entry at from to to, which takes over from's place in the stack
+            void move_state_guard(effect_entry_t* from, effect_entry_t* to) {
+                *to = *from;
 
-                stack[index_in_stack].is_destructed = true;
+                if(to->stack && (to->stack->pending == from)) {
+                    to->stack->pending = to;
+                }
+                else if(to->stack) {
+                    to->below->above = to; // only the base entry has nothing below it, and the base entry never moves
+                    if(to->above) {
+                        to->above->below = to;
+                    }
+                    else {
+                        to->stack->top = to;
+                    }
+                }
 
-                if(index_in_stack == stack.size()-1) {
-                    unsigned i = stack.size();
+                from->stack = nullptr;
+                from->below = nullptr;
+                from->above = nullptr;
+            }
 
-                    while((i > 0) && (stack[i-1].is_destructed)) { // pop all already-destructed state guards
-                        stack.pop_back();                          // note that we can't pop empty (default constructed) state guards, because they're still valid and could be assigned to at any time
+            void swap_state_guards(effect_entry_t* a, effect_entry_t* b) {
+                effect_entry_t temp;           // each move relinks the neighbors of the entry it moves,
+                move_state_guard(a, &temp);    // so this works even if a and b are adjacent in the same stack
+                move_state_guard(b, a);
+                move_state_guard(&temp, b);
 
-                        --i;
+                for(auto entry : {a, b}) { // the entries swapped places, so the top of either stack might be different now
+                    if(entry->stack) {
+                        ++entry->stack->generation;
+
+                        for(auto above = logically_above(&entry->stack->base); above; above = logically_above(above)) {
+                            inherit_state(above, above->below ? above->below : entry->stack->top);
+                        }
                     }
                 }
+            }
+
+            void delete_state_guard(std::ostream* stream, effect_entry_t* entry) {
+                IRO_TRACE_SCOPE(trace_delete, stream);
 
-                for(unsigned effect_type_index = 0; effect_type_index < number_of_effect_types; ++effect_type_index) {
-                    auto top_code = get_top_code(stream, static_cast<effect_type>(effect_type_index));
-                    *stream << top_code;
-                    if(stdout_isatty() && stderr_isatty()) { // TODO: put this in a function to get rid of code duplication
-                        for(unsigned i = 0; i < 2; ++i) {
-                            if(stream == streams_[i]) {
-                                *streams_[!i] << top_code;
-                                break;
-                            }               // ^ !i turns 0 into 1 and 1 into 0,
-                                            // so this basically says "if the stream is cout, also print this effect to cerr,
-                                            // and if the stream is cerr, also print this effect to cout
+                auto& stack = *entry->stack;
+                ++stack.generation;
+                --stack.depth;
+
+                if(stack.pending == entry) { // nothing was pushed on top of this state guard, so only the effect types it set can have changed
+                    stack.pending = nullptr;
+                    entry->stack = nullptr;
+
+                    unsigned changed_types = 0;
+                    const char* code = nullptr;
+                    for(unsigned effect_type_index = 0; effect_type_index < number_of_effect_types; ++effect_type_index) {
+                        if(entry->type_to_code[effect_type_index]) {
+                            ++changed_types;
+                            code = stack.top->state[effect_type_index];
                         }
                     }
+                    if(changed_types) {
+                        write_code(stream, (changed_types == 1) ? code : stack.top->state_code);
+                    }
+                    return;
+                }
+
+                auto below = entry->below;
+                auto above = logically_above(entry);
+
+                entry->below->above = entry->above; // entries don't have to be at the top of the stack to be unlinked
+                if(entry->above) {
+                    entry->above->below = entry->below;
+                }
+                else {
+                    stack.top = entry->below;
+                }
+
+                entry->stack = nullptr;
+                entry->below = nullptr;
+                entry->above = nullptr;
+
+                for(; above; below = above, above = logically_above(above)) { // everything above the deleted entry was inheriting from it
+                    inherit_state(above, below);
                 }
+
+                write_code(stream, logical_top(stack)->state_code);
             }
 
-            void set(std::ostream* stream, unsigned index, effect_type type, const char* code) {
-                auto& stack = stream_to_stack_.at(stream);
-                stack[index].type_to_code[type] = code;
-                stack[index].is_empty = false;
+            void set(std::ostream* stream, effect_entry_t* entry, effect_type type, const char* code) {
+                IRO_TRACE_SCOPE(trace_set, stream);
+                entry->type_to_code[type] = code;
+                entry->is_empty = false;
+                entry->state[type] = code;
+                update_state_code(entry);
 
                 bool is_top_non_empty = true;
-                for(unsigned i = index+1; i < stack.size(); ++i) {
-                    is_top_non_empty &= !(stack[i].type_to_code[type]);
+                for(auto above = logically_above(entry); above; above = logically_above(above)) {
+                    if(above->type_to_code[type]) {
+                        is_top_non_empty = false;
+                        break;
+                    }
+
+                    above->state[type] = code;
+                    update_state_code(above);
                 }
+
                 if(is_top_non_empty) {
-                    *stream << code;
-
-                    if(stdout_isatty() && stderr_isatty()) {
-                        for(unsigned i = 0; i < 2; ++i) {
-                            if(stream == streams_[i]) {
-                                *streams_[!i] << code;
-                                break;
-                            }          // ^ !i turns 0 into 1 and 1 into 0,
-                                       // so this basically says "if the stream is cout, also print this effect to cerr,
-                                       // and if the stream is cerr, also print this effect to cout
-                        }
-                    }
+                    ++entry->stack->generation;
+                    write_code(stream, code);
                 }
             }
 
-            void set(std::ostream* stream, unsigned index, const effect_set& effects) {
+            void set(std::ostream* stream, effect_entry_t* entry, const effect_set& effects) {
+                IRO_TRACE_SCOPE(trace_set, stream);
                 for(unsigned i = 0; i < effects.type_to_code_.size(); ++i) {
                     if(effects.type_to_code_[i]) { // TODO: In order to have this work with state guard assignment operators, you'll have to change this so that when the code is empty,
                                                    // it cleans up the old state guard's state. This will involve walking down the stack and finding the last non-empty code for the given effect type
-                        set(stream, index, static_cast<effect_type>(i), effects.type_to_code_[i]);
+                        set(stream, entry, static_cast<effect_type>(i), effects.type_to_code_[i]);
                     }
                 }
             }
 
-            bool state_guard_has_effect_of_type(std::ostream* stream, unsigned index, effect_type type) {
-                return stream_to_stack_.at(stream)[index].type_to_code[type];
+            bool state_guard_has_effect_of_type(const effect_entry_t* entry, effect_type type) {
+                return entry->type_to_code[type];
             }
 
             void set_top(std::ostream* stream, effect_type type, const char* code) {
-                set(stream, stream_to_stack_.at(stream).size()-1, type, code);
+                set(stream, logical_top(get_stack(stream)), type, code);
             }
 
-            // TODO: maybe change this function so that it just takes a stream and returns a single string with all effect codes
-            const char* get_top_code(const std::ostream* stream, effect_type type) {
-                if(!stream_to_stack_.count(stream)) { // I'm using c++14, so .contains() isn't available :(
-                    stream_to_stack_[stream].push_back({effect_type_to_default_code_});
-                }
-                auto& stack = stream_to_stack_.at(stream);
+            std::uint64_t state_generation(const std::ostream* stream) {
+                return get_stack(stream).generation;
+            }
 
-                for(unsigned i = stack.size(); i > 0; --i) {
-                    if(stack[i-1].type_to_code[type]) { // find first code that isn't null
-                        return stack[i-1].type_to_code[type];
-                    }
-                }
+            const char* get_top_code(const std::ostream* stream, effect_type type) {
+                return logical_top(get_stack(stream))->state[type];
+            }
 
-                assert(false);
+            const char* get_top_state_code(const std::ostream* stream) {
+                return logical_top(get_stack(stream))->state_code;
             }
 
             void reapply_top(std::ostream* stream, effect_type type) {
@@ -913,4 +2648,10 @@ namespace iro {
 #endif // #ifdef IRO_IMPL
 
 #undef IRO_WINDOWS
-#undef IRO_UNIX
\ No newline at end of file
+#undef IRO_UNIX
+#undef IRO_RETURN_ADDRESS
+#undef IRO_TRACE_ENTRY_POINT
+#undef IRO_TRACE_CALL_SITE
+#undef IRO_TRACE_SCOPE
+
+#endif // #if (!defined(IRO_LEAN) || defined(IRO_IMPL)) && !defined(IRO_H_EVERYTHING_ELSE)
@@ -0,0 +1,17 @@
+#include <iostream>
+
+// this file links against the compiled iro library, so it doesn't define IRO_IMPL
+// and it only uses effects and state guards, so it can skip the rest of iro.h
+#define IRO_LEAN
+#include "iro.h"
+
+int main() {
+    std::cout << iro::bright_cyan << "[info] " << "iro.h was included with IRO_LEAN\n";
+
+    {
+        iro::terminal_state_guard tsg = std::cout << iro::bold;
+        std::cout << iro::yellow << "[warning] " << "this is bold and yellow\n";
+        std::cout << "this is just bold\n";
+    }
+    std::cout << "this text is normal\n";
+}
@@ -0,0 +1,183 @@
+// Tests for iro::arena and for effect_strings that allocate from a memory_resource. Run with ctest
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#define IRO_IMPL
+#include "iro.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if(!(condition)) {                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition "\n"; \
+            ++failures;                                                                   \
+        }                                                                                 \
+    } while(false)
+
+// forwards to another memory_resource and counts what goes through it
+struct counting_resource : iro::memory_resource {
+    iro::memory_resource& upstream;
+    std::size_t bytes = 0;
+    std::size_t live_allocations = 0;
+
+    explicit counting_resource(iro::memory_resource& upstream) : upstream(upstream) {}
+
+    void* allocate(std::size_t n, std::size_t alignment) override {
+        bytes += n;
+        ++live_allocations;
+        return upstream.allocate(n, alignment);
+    }
+
+    void deallocate(void* p, std::size_t n, std::size_t alignment) override {
+        --live_allocations;
+        upstream.deallocate(p, n, alignment);
+    }
+};
+
+static std::string render(const iro::effect_string& es) {
+    std::ostringstream out;
+    out << es;
+    return out.str();
+}
+
+// comfortably more than detail::effect_string_chunk_size, so there are several sealed chunks
+static iro::effect_string make_big(iro::memory_resource& resource) {
+    iro::effect_string ret(resource);
+    for(int i = 0; i < 2000; ++i) {
+        ret << iro::effect_string(resource, (i%2) ? iro::red : iro::bold, "piece ", i) << " and some plain text";
+    }
+    return ret;
+}
+
+static void test_arena_allocation() {
+    iro::arena a(256);
+
+    for(std::size_t alignment : {1, 2, 8, 16, 64}) {
+        for(std::size_t size : {1, 3, 100, 255}) {
+            auto p = static_cast<unsigned char*>(a.allocate(size, alignment));
+            CHECK(p != nullptr);
+            CHECK(reinterpret_cast<std::uintptr_t>(p)%alignment == 0);
+            std::memset(p, 0xab, size); // ASan complains here if the memory isn't really there
+        }
+    }
+
+    // bigger than a block, so it gets a block of its own
+    auto big = static_cast<unsigned char*>(a.allocate(10000, 64));
+    CHECK(reinterpret_cast<std::uintptr_t>(big)%64 == 0);
+    std::memset(big, 0xcd, 10000);
+
+    // allocations never overlap
+    auto first  = static_cast<char*>(a.allocate(64, 8));
+    auto second = static_cast<char*>(a.allocate(64, 8));
+    std::memset(first, 1, 64);
+    std::memset(second, 2, 64);
+    CHECK((first[63] == 1) && (second[0] == 2));
+
+    a.deallocate(first, 64, 8); // does nothing, but has to be allowed
+}
+
+static void test_same_resource_shares_chunks() {
+    iro::arena a;
+    counting_resource counter(a);
+
+    auto big = make_big(counter);
+    auto text = render(big);
+    CHECK(text.size() > 10*iro::detail::effect_string_chunk_size);
+
+    // copying shares the chunks, so it only allocates for the strings that haven't been sealed yet (less than a chunk's worth of text, plus the vector they're in)
+    std::size_t before = counter.bytes;
+    iro::effect_string copy = big;
+    CHECK(counter.bytes-before < text.size()/4);
+    CHECK(render(copy) == text);
+
+    // so does concatenating
+    before = counter.bytes;
+    iro::effect_string concatenated(counter);
+    concatenated << "prefix " << big;
+    CHECK(counter.bytes-before < text.size()/2);
+    CHECK(render(concatenated) == "prefix " + text);
+
+    // appending to a copy doesn't change the original
+    copy << iro::effect_string(counter, iro::underlined, "more");
+    CHECK(render(big) == text);
+}
+
+static void test_different_resources_copy_segments() {
+    iro::arena a, b;
+    counting_resource counter_a(a), counter_b(b);
+
+    auto big = make_big(counter_a);
+    auto text = render(big);
+
+    iro::effect_string other(counter_b);
+    other << big;
+    CHECK(counter_b.bytes >= text.size()/2); // the text has to have been copied into b (the escape codes aren't stored as text, so it's less than text.size())
+    CHECK(render(other) == text);
+
+    // nothing that other owns may come from a, so it has to survive a's strings going away
+    std::size_t a_bytes = counter_a.bytes;
+    big = iro::effect_string(counter_a);
+    other << iro::effect_string(counter_b, iro::blue, "!");
+    CHECK(counter_a.bytes-a_bytes < 1024);
+    CHECK(render(other).find("!") != std::string::npos);
+}
+
+static void test_assignment_propagates_resource() {
+    iro::arena a, b;
+    counting_resource counter_a(a), counter_b(b);
+
+    iro::effect_string x(counter_a, iro::red, "x");
+    iro::effect_string y(counter_b, iro::green, "y");
+
+    x = y;
+    std::size_t a_bytes = counter_a.bytes;
+    std::size_t b_bytes = counter_b.bytes;
+    for(int i = 0; i < 100; ++i) {
+        x << iro::effect_string(counter_b, (i%2) ? iro::bold : iro::faint, i);
+    }
+    CHECK(counter_a.bytes == a_bytes);
+    CHECK(counter_b.bytes > b_bytes);
+
+    iro::effect_string z(counter_a);
+    z = std::move(x);
+    z << iro::effect_string(iro::blue, "default resource");
+    CHECK(counter_a.bytes == a_bytes);
+}
+
+static void test_release() {
+    iro::arena a(512);
+    counting_resource counter(a);
+
+    for(int round = 0; round < 3; ++round) {
+        {
+            auto big = make_big(counter);
+            CHECK(render(big).size() > 10*iro::detail::effect_string_chunk_size);
+        }
+        CHECK(counter.live_allocations == 0); // every effect_string gave its memory back (which the arena ignores)
+        a.release();
+    }
+
+    // still usable after being released
+    auto p = static_cast<char*>(a.allocate(100, 16));
+    std::memset(p, 0, 100);
+    CHECK(reinterpret_cast<std::uintptr_t>(p)%16 == 0);
+}
+
+int main() {
+    test_arena_allocation();
+    test_same_resource_shares_chunks();
+    test_different_resources_copy_segments();
+    test_assignment_propagates_resource();
+    test_release();
+
+    if(failures) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "all checks passed\n";
+}